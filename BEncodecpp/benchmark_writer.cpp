@@ -0,0 +1,78 @@
+#include "bencode.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+
+// Writer throughput and allocations on a large multi-file torrent; run
+// without arguments, built with optimizations.
+
+static long long allocations = 0;
+
+void* operator new(std::size_t size)
+{
+	++allocations;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	free(p);
+}
+
+// 50000 files of two path elements each, and a 200 KB pieces string.
+static Bencode::Value makeTorrent()
+{
+	Bencode::Value files(Bencode::listValue);
+	for (int index = 1; index <= 50000; ++index)
+	{
+		Bencode::Value file(Bencode::dictValue);
+		file["length"] = index * 37;
+		Bencode::Value path(Bencode::listValue);
+		path.append(Bencode::Value("dir"));
+		path.append(Bencode::Value("file" + std::to_string(index) + ".bin"));
+		file["path"] = path;
+		files.append(file);
+	}
+	Bencode::Value info(Bencode::dictValue);
+	info["files"] = files;
+	info["name"] = Bencode::Value("dataset");
+	info["piece length"] = 262144;
+	info["pieces"] = Bencode::Value(std::string(200000, 'p'));
+	Bencode::Value torrent(Bencode::dictValue);
+	torrent["announce"] = Bencode::Value("http://tracker.example/announce");
+	torrent["info"] = info;
+	return torrent;
+}
+
+int main()
+{
+	const int rounds = 20;
+	Bencode::Value torrent = makeTorrent();
+	Bencode::Writer writer;
+	Bencode::UInt length = writer.write(torrent);	// grows the buffer and the traversal stack
+
+	long long allocationsBefore = allocations;
+	std::size_t total = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; ++round)
+		total += writer.write(torrent);
+	std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+	long long allocationsDuring = allocations - allocationsBefore;
+
+	double milliseconds = std::chrono::duration<double, std::milli>(stop - start).count();
+	std::cout << length << " bytes/doc, "
+		<< milliseconds / rounds << " ms/doc, "
+		<< total / milliseconds / 1000.0 << " MB/s, "
+		<< double(allocationsDuring) / rounds << " allocations/doc" << std::endl;
+	return 0;
+}
@@ -4,5 +4,12 @@
 #include "value.h"
 #include "reader.h"
 #include "writer.h"
+#include "sink.h"
+#include "query.h"
+#include "filter.h"
+#include "canonicalizer.h"
+#include "traversal.h"
+#include "reclaimer.h"
+#include "frozen.h"
 
 #endif // !BENCODE_BENCODE_H_INCLUDED
@@ -0,0 +1,322 @@
+#include "canonicalizer.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace Bencode {
+
+	// Order of member names: bytes compared as unsigned, a prefix first.
+	static int compareNames(const char* a, std::size_t aLength, const char* b, std::size_t bLength)
+	{
+		int comparison = memcmp(a, b, aLength < bLength ? aLength : bLength);
+		if (comparison != 0)
+			return comparison;
+		return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+	}
+
+	// class Canonicalizer
+	// //////////////////////////////////////////////////////////////////
+
+	Canonicalizer::Canonicalizer()
+		: begin_(0)
+		, runStart_(0)
+		, changed_(false)
+	{
+	}
+
+	bool Canonicalizer::run(const char* begin, const char* end, OutputSink& sink)
+	{
+		if (!scan(begin, end))
+			return false;
+		for (std::size_t index = 0; index < pieces_.size(); ++index)
+		{
+			const Piece& piece = pieces_[index];
+			if (piece.rewritten_)
+			{
+				sink.write(piece.data_, piece.length_);
+				continue;
+			}
+			// members left in place by a reordering come out as one run again
+			std::size_t length = piece.length_;
+			while (index + 1 < pieces_.size() && !pieces_[index + 1].rewritten_
+				&& pieces_[index + 1].data_ == piece.data_ + length)
+				length += pieces_[++index].length_;
+			sink.writeReference(piece.data_, length);
+		}
+		return sink.flush();
+	}
+
+	bool Canonicalizer::check(const char* begin, const char* end)
+	{
+		return scan(begin, end);
+	}
+
+	bool Canonicalizer::changed() const
+	{
+		return changed_;
+	}
+
+	const std::string& Canonicalizer::error() const
+	{
+		return error_;
+	}
+
+	// Describe the canonical form of [begin, end) in pieces_.
+	bool Canonicalizer::scan(const char* begin, const char* end)
+	{
+		begin_ = runStart_ = begin;
+		pieces_.clear();
+		members_.clear();
+		frames_.clear();
+		changed_ = false;
+		error_.clear();
+		const char* current = begin;
+		for (;;)
+		{
+			// the value at current
+			if (current == end)
+				return fail(current, "value expected");
+			char c = *current;
+			if (c == 'd' || c == 'l')
+			{
+				Frame frame;
+				frame.isDict_ = c == 'd';
+				frame.ordered_ = true;
+				frame.membersBegin_ = members_.size();
+				frames_.push_back(frame);
+				++current;
+			}
+			else if (c == 'i')
+			{
+				if (!readInteger(current, end))
+					return false;
+			}
+			else if (c >= '0' && c <= '9')
+			{
+				if (!readString(current, end, 0, 0))
+					return false;
+			}
+			else
+			{
+				return fail(current, "value expected");
+			}
+
+			// close the containers that end there, then start the next member
+			for (;;)
+			{
+				if (frames_.empty())
+				{
+					if (current != end)
+						return fail(current, "data after the end of the document");
+					closeRun(end);
+					return true;
+				}
+				if (current == end)
+					return fail(current, "unexpected end of input");
+				if (*current != 'e')
+					break;
+				const Frame& frame = frames_.back();
+				if (frame.isDict_)
+				{
+					if (!frame.ordered_)
+						reorder(current);
+					members_.resize(frame.membersBegin_);
+				}
+				frames_.pop_back();
+				++current;
+			}
+			Frame& frame = frames_.back();
+			if (frame.isDict_)
+			{
+				if (*current < '0' || *current > '9')
+					return fail(current, "member name expected");
+				Member member;
+				member.piece_ = pieces_.size();
+				member.position_ = current;
+				if (!readString(current, end, &member.name_, &member.nameLength_))
+					return false;
+				if (members_.size() > frame.membersBegin_)
+				{
+					const Member& previous = members_.back();
+					if (compareNames(previous.name_, previous.nameLength_, member.name_, member.nameLength_) >= 0)
+						frame.ordered_ = false;
+				}
+				members_.push_back(member);
+			}
+		}
+	}
+
+	// "i<digits>e", with an optional '-' and no digit read as 0, like Reader
+	// does; leading zeros and the sign of 0 are dropped.
+	bool Canonicalizer::readInteger(const char*& current, const char* end)
+	{
+		const char* sign = ++current;
+		bool isNegative = current != end && *current == '-';
+		if (isNegative)
+			++current;
+		const char* digits = current;
+		while (current != end && *current >= '0' && *current <= '9')
+			++current;
+		if (current == end || *current != 'e')
+			return fail(current, "invalid integer");
+		const char* significant = digits;
+		while (significant != current && *significant == '0')
+			++significant;
+		if (significant == current)
+		{
+			if (current - sign != 1 || isNegative)
+				replace(sign, current, "0");
+		}
+		else if (significant != digits)
+		{
+			replace(sign, significant, isNegative ? "-" : "");
+		}
+		++current;
+		return true;
+	}
+
+	// "<length>:<bytes>"; the leading zeros of the length are dropped. The
+	// bytes are stored in data and length if they are not null.
+	bool Canonicalizer::readString(const char*& current, const char* end, const char** data, std::size_t* length)
+	{
+		const char* start = current;
+		std::size_t size = 0;
+		for (; current != end && *current >= '0' && *current <= '9'; ++current)
+		{
+			if (size > std::size_t(end - begin_))
+				return fail(start, "string longer than the input");
+			size = size * 10 + std::size_t(*current - '0');
+		}
+		if (current == end || *current != ':')
+			return fail(current, "':' expected after the string length");
+		const char* significant = start;
+		while (significant != current && *significant == '0')
+			++significant;
+		if (significant == current)
+		{
+			if (current - start != 1)
+				replace(start, current, "0");
+		}
+		else if (significant != start)
+		{
+			replace(start, significant, "");
+		}
+		++current;
+		if (size > std::size_t(end - current))
+			return fail(start, "string longer than the input");
+		if (data)
+		{
+			*data = current;
+			*length = size;
+		}
+		current += size;
+		return true;
+	}
+
+	// Write the static text instead of the input in [begin, end).
+	void Canonicalizer::replace(const char* begin, const char* end, const char* text)
+	{
+		closeRun(begin);
+		Piece piece;
+		piece.data_ = text;
+		piece.length_ = strlen(text);
+		piece.rewritten_ = true;
+		if (piece.length_)
+			pieces_.push_back(piece);
+		runStart_ = end;
+		changed_ = true;
+	}
+
+	// Add the input bytes up to position that are not in pieces_ yet.
+	void Canonicalizer::closeRun(const char* position)
+	{
+		if (position == runStart_)
+			return;
+		Piece piece;
+		piece.data_ = runStart_;
+		piece.length_ = std::size_t(position - runStart_);
+		piece.rewritten_ = false;
+		pieces_.push_back(piece);
+		runStart_ = position;
+	}
+
+	// Put the members of the innermost dict, which ends at position, in the
+	// order of their names, keeping the last of duplicates. Only the pieces
+	// describing them are moved.
+	void Canonicalizer::reorder(const char* position)
+	{
+		closeRun(position);
+		const Frame& frame = frames_.back();
+		const Member* members = &members_[frame.membersBegin_];
+		std::size_t count = members_.size() - frame.membersBegin_;
+		std::size_t first = members[0].piece_;
+
+		// cut the pieces where each member starts: member i is then
+		// cut_[bounds_[i], bounds_[i + 1]), after the beginning of the dict
+		cut_.clear();
+		bounds_.clear();
+		std::size_t member = 0;
+		for (std::size_t index = first; index < pieces_.size(); ++index)
+		{
+			const Piece& piece = pieces_[index];
+			std::size_t from = 0;
+			for (;;)
+			{
+				bool starts = member < count && members[member].piece_ == index;
+				std::size_t to = piece.length_;
+				if (starts)
+				{
+					// the member starts in this piece, or before it if that was rewritten
+					const char* start = members[member].position_;
+					to = !piece.rewritten_ && start > piece.data_ ? std::size_t(start - piece.data_) : 0;
+				}
+				if (to > from)
+				{
+					Piece part = piece;
+					part.data_ += from;
+					part.length_ = to - from;
+					cut_.push_back(part);
+					from = to;
+				}
+				if (!starts)
+					break;
+				bounds_.push_back(cut_.size());
+				++member;
+			}
+		}
+		for (; member <= count; ++member)
+			bounds_.push_back(cut_.size());
+
+		order_.resize(count);
+		for (std::size_t index = 0; index < count; ++index)
+			order_[index] = index;
+		std::stable_sort(order_.begin(), order_.end(), [members](std::size_t a, std::size_t b)
+		{
+			return compareNames(members[a].name_, members[a].nameLength_, members[b].name_, members[b].nameLength_) < 0;
+		});
+
+		pieces_.resize(first);
+		pieces_.insert(pieces_.end(), cut_.begin(), cut_.begin() + bounds_[0]);
+		for (std::size_t index = 0; index < count; ++index)
+		{
+			std::size_t kept = order_[index];
+			if (index + 1 < count)
+			{
+				const Member& next = members[order_[index + 1]];
+				if (compareNames(members[kept].name_, members[kept].nameLength_, next.name_, next.nameLength_) == 0)
+					continue;	// a later duplicate replaces it
+			}
+			pieces_.insert(pieces_.end(), cut_.begin() + bounds_[kept], cut_.begin() + bounds_[kept + 1]);
+		}
+		changed_ = true;
+	}
+
+	bool Canonicalizer::fail(const char* position, const char* message)
+	{
+		char offset[32];
+		snprintf(offset, sizeof(offset), "%llu", (unsigned long long)(position - begin_));
+		error_ = std::string("Offset ") + offset + ": " + message;
+		return false;
+	}
+
+} // namespace Bencode
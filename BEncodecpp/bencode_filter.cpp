@@ -0,0 +1,667 @@
+#include "filter.h"
+#include <map>
+#include <istream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+
+namespace Bencode {
+
+	// class Filter::Rule
+	// //////////////////////////////////////////////////////////////////
+
+	// Node of the rule tree: what applies to the values reached by one path.
+	class Filter::Rule
+	{
+	public:
+		Rule()
+			: action_(actionCopy)
+			, keep_(false)
+			, keepBelow_(false)
+		{
+		}
+
+		bool hasChildren() const
+		{
+			return !members_.empty() || !elements_.empty() || any_;
+		}
+
+		Action action_;	// actionCopy (no rule), actionDrop or actionReplace
+		std::string replacement_;	// encoded
+		bool keep_;
+		bool keepBelow_;	// a descendant is kept
+		std::map<std::string, std::unique_ptr<Rule>, std::less<> > members_;
+		std::map<ArrayIndex, std::unique_ptr<Rule> > elements_;
+		std::unique_ptr<Rule> any_;	// ".*" or "[*]"
+	};
+
+	// class Filter::Parser
+	// //////////////////////////////////////////////////////////////////
+
+	class Filter::Parser
+	{
+	public:
+		explicit Parser(const std::string& path)
+			: path_(path)
+			, current_(0)
+		{
+		}
+
+		/// Walk path down from root, creating the missing rules; mark the
+		/// rules passed through when keep is set.
+		Rule& parse(Rule& root, bool keep)
+		{
+			Rule* rule = &root;
+			if (path_ == ".")
+				return root;
+			if (atEnd())
+				invalid("'.' or '[' expected");
+			while (!atEnd())
+			{
+				if (keep)
+					rule->keepBelow_ = true;
+				char c = path_[current_++];
+				std::string name;
+				ArrayIndex index;
+				if (c == '.' && peek('*'))
+				{
+					++current_;
+					rule = &child(rule->any_);
+				}
+				else if (c == '.')
+				{
+					std::string::size_type begin = current_;
+					while (!atEnd() && path_[current_] != '.' && path_[current_] != '[')
+						++current_;
+					if (current_ == begin)
+						invalid("member name expected");
+					name.assign(path_, begin, current_ - begin);
+					rule = &child(rule->members_[name]);
+				}
+				else if (c == '[' && peek('*'))
+				{
+					++current_;
+					expect(']');
+					rule = &child(rule->any_);
+				}
+				else if (c == '[' && readQuoted(name))
+				{
+					expect(']');
+					rule = &child(rule->members_[name]);
+				}
+				else if (c == '[' && readIndex(index))
+				{
+					expect(']');
+					rule = &child(rule->elements_[index]);
+				}
+				else
+				{
+					--current_;
+					invalid(c == '[' ? "index, '*' or quoted name expected" : "'.' or '[' expected");
+				}
+			}
+			return *rule;
+		}
+
+	private:
+		static Rule& child(std::unique_ptr<Rule>& slot)
+		{
+			if (!slot)
+				slot.reset(new Rule);
+			return *slot;
+		}
+
+		bool atEnd() const
+		{
+			return current_ == path_.length();
+		}
+
+		bool peek(char c) const
+		{
+			return !atEnd() && path_[current_] == c;
+		}
+
+		void expect(char c)
+		{
+			if (!peek(c))
+				invalid(std::string("'") + c + "' expected");
+			++current_;
+		}
+
+		bool readQuoted(std::string& text)
+		{
+			if (!peek('\'') && !peek('"'))
+				return false;
+			char quote = path_[current_++];
+			std::string::size_type begin = current_;
+			while (!atEnd() && path_[current_] != quote)
+				++current_;
+			if (atEnd())
+				invalid("unterminated string");
+			text.assign(path_, begin, current_ - begin);
+			++current_;
+			return true;
+		}
+
+		bool readIndex(ArrayIndex& index)
+		{
+			if (atEnd() || path_[current_] < '0' || path_[current_] > '9')
+				return false;
+			index = 0;
+			for (; !atEnd() && path_[current_] >= '0' && path_[current_] <= '9'; ++current_)
+				index = index * 10 + ArrayIndex(path_[current_] - '0');
+			return true;
+		}
+
+		void invalid(const std::string& message)
+		{
+			char position[16];
+			snprintf(position, sizeof(position), "%u", unsigned(current_));
+			throw std::runtime_error("Invalid filter path '" + path_ + "' at position "
+				+ position + ": " + message);
+		}
+
+		const std::string& path_;
+		std::string::size_type current_;
+	};
+
+	// class Filter::Input
+	// //////////////////////////////////////////////////////////////////
+
+	/* Window [current_, end_) on the input: the whole range, or the unread
+	 * part of a buffer refilled from a stream. While a copy is open, the
+	 * bytes passed over since mark_ are written to the sink before the
+	 * window moves.
+	 */
+	class Filter::Input
+	{
+	public:
+		static const std::size_t bufferSize = 64 * 1024;
+
+		Input(const char* begin, const char* end)
+			: current_(begin)
+			, end_(end)
+			, windowBegin_(begin)
+			, windowOffset_(0)
+			, mark_(0)
+			, sink_(0)
+			, stream_(0)
+		{
+		}
+
+		explicit Input(std::istream& stream)
+			: current_(0)
+			, end_(0)
+			, windowBegin_(0)
+			, windowOffset_(0)
+			, mark_(0)
+			, sink_(0)
+			, stream_(&stream)
+			, buffer_(bufferSize)
+		{
+			current_ = end_ = windowBegin_ = &buffer_[0];
+		}
+
+		/// Make length bytes available from current(); false past the end of the input.
+		bool need(std::size_t length)
+		{
+			return std::size_t(end_ - current_) >= length || refill(length);
+		}
+
+		const char* current() const
+		{
+			return current_;
+		}
+
+		/// Pass over length bytes made available by need().
+		void advance(std::size_t length)
+		{
+			current_ += length;
+		}
+
+		/// Pass over length bytes, which may extend past the window.
+		bool skip(std::size_t length)
+		{
+			while (length > std::size_t(end_ - current_))
+			{
+				length -= std::size_t(end_ - current_);
+				current_ = end_;
+				if (!refill(1))
+					return false;
+			}
+			current_ += length;
+			return true;
+		}
+
+		/// Copy the bytes passed over from now on to sink, until endCopy().
+		void beginCopy(OutputSink& sink)
+		{
+			sink_ = &sink;
+			mark_ = current_;
+		}
+
+		void endCopy()
+		{
+			sink_->write(mark_, std::size_t(current_ - mark_));
+			mark_ = 0;
+		}
+
+		bool peekLength(std::size_t& prefixLength, std::size_t& length);
+		bool skipValue();
+
+		/// Offset of current() in the input.
+		std::size_t offset() const
+		{
+			return windowOffset_ + std::size_t(current_ - windowBegin_);
+		}
+
+	private:
+		bool refill(std::size_t length)
+		{
+			if (!stream_)
+				return false;
+			if (mark_)
+				sink_->write(mark_, std::size_t(current_ - mark_));
+			// move the unread bytes to the front, growing the buffer for a long key
+			std::size_t unread = std::size_t(end_ - current_);
+			windowOffset_ += std::size_t(current_ - windowBegin_);
+			if (length > buffer_.size())
+			{
+				std::vector<char> grown(length > 2 * buffer_.size() ? length : 2 * buffer_.size());
+				memcpy(&grown[0], current_, unread);
+				buffer_.swap(grown);
+			}
+			else
+			{
+				memmove(&buffer_[0], current_, unread);
+			}
+			current_ = windowBegin_ = &buffer_[0];
+			end_ = current_ + unread;
+			if (mark_)
+				mark_ = current_;
+			while (std::size_t(end_ - current_) < length)
+			{
+				stream_->read(const_cast<char*>(end_), std::streamsize(buffer_.size() - std::size_t(end_ - current_)));
+				std::size_t read = std::size_t(stream_->gcount());
+				if (read == 0)
+					return false;
+				end_ += read;
+			}
+			return true;
+		}
+
+		const char* current_;
+		const char* end_;
+		const char* windowBegin_;
+		std::size_t windowOffset_;	// of windowBegin_ in the input
+		const char* mark_;	// start of the bytes to copy, or 0
+		OutputSink* sink_;
+		std::istream* stream_;
+		std::vector<char> buffer_;
+		std::vector<char> open_;	// used by skipValue(), kept to reuse the memory
+	};
+
+	static bool typeOf(char c, ValueType& type)
+	{
+		if (c == 'd')
+			type = dictValue;
+		else if (c == 'l')
+			type = listValue;
+		else if (c == 'i')
+			type = intValue;
+		else if (c >= '0' && c <= '9')
+			type = stringValue;
+		else
+			return false;
+		return true;
+	}
+
+	// Read the "<length>:" prefix of a string at current() without moving
+	// past it: prefixLength bytes, for a string of length bytes.
+	bool Filter::Input::peekLength(std::size_t& prefixLength, std::size_t& length)
+	{
+		length = 0;
+		for (prefixLength = 0; ; ++prefixLength)
+		{
+			if (!need(prefixLength + 1))
+				return false;
+			char c = current_[prefixLength];
+			if (c == ':')
+				break;
+			if (c < '0' || c > '9' || prefixLength == 19)
+				return false;
+			length = length * 10 + std::size_t(c - '0');
+		}
+		++prefixLength;
+		return prefixLength > 1;
+	}
+
+	// Pass over the value at current(), nested values included, checking
+	// that it is valid: integers in canonical form, dict names as strings.
+	bool Filter::Input::skipValue()
+	{
+		// the open containers: 'l', or 'd' before a member name and 'v' before its value
+		open_.clear();
+		do
+		{
+			if (!need(1))
+				return false;
+			char c = *current_;
+			char* state = open_.empty() ? 0 : &open_.back();
+			if (c == 'e')
+			{
+				if (!state || *state == 'v')
+					return false;
+				open_.pop_back();
+				advance(1);
+				continue;
+			}
+			if (state && *state == 'v')
+				*state = 'd';
+			else if (state && *state == 'd')
+			{
+				if (c < '0' || c > '9')
+					return false;
+				*state = 'v';
+			}
+			if (c == 'd' || c == 'l')
+			{
+				open_.push_back(c);
+				advance(1);
+			}
+			else if (c == 'i')
+			{
+				// "i0e", or an optional '-' and digits without leading zeros
+				advance(1);
+				if (!need(1))
+					return false;
+				bool isNegative = *current_ == '-';
+				if (isNegative)
+				{
+					advance(1);
+					if (!need(1))
+						return false;
+				}
+				c = *current_;
+				if (c < '0' || c > '9' || (c == '0' && isNegative))
+					return false;
+				bool isZero = c == '0';
+				for (;;)
+				{
+					advance(1);
+					if (!need(1))
+						return false;
+					c = *current_;
+					if (c == 'e')
+						break;
+					if (c < '0' || c > '9' || isZero)
+						return false;
+				}
+				advance(1);
+			}
+			else
+			{
+				std::size_t prefixLength;
+				std::size_t length;
+				if (!peekLength(prefixLength, length))
+					return false;
+				current_ += prefixLength;
+				if (!skip(length))
+					return false;
+			}
+		} while (!open_.empty());
+		return true;
+	}
+
+	// class Filter
+	// //////////////////////////////////////////////////////////////////
+
+	Filter::Filter()
+		: root_(new Rule)
+		, keepMode_(false)
+	{
+	}
+
+	Filter::~Filter()
+	{
+	}
+
+	void Filter::drop(const std::string& path)
+	{
+		rule(path, false).action_ = actionDrop;
+	}
+
+	void Filter::keep(const std::string& path)
+	{
+		rule(path, true).keep_ = true;
+		keepMode_ = true;
+	}
+
+	void Filter::replace(const std::string& path, const Value& value)
+	{
+		Rule& replaced = rule(path, false);
+		if (value.type() == nullValue)
+		{
+			replaced.action_ = actionDrop;	// null has no encoding
+			return;
+		}
+		UInt length = writer_.write(value);
+		replaced.action_ = actionReplace;
+		replaced.replacement_.assign(writer_.getCString(), length);
+	}
+
+	const std::string& Filter::error() const
+	{
+		return error_;
+	}
+
+	Filter::Rule& Filter::rule(const std::string& path, bool keep)
+	{
+		Parser parser(path);
+		return parser.parse(*root_, keep);
+	}
+
+	bool Filter::run(const char* begin, const char* end, OutputSink& sink)
+	{
+		return runRange(begin, end, sink, 0, 0);
+	}
+
+	bool Filter::run(std::istream& in, OutputSink& sink)
+	{
+		return runStream(in, sink, 0, 0);
+	}
+
+	bool Filter::runRange(const char* begin, const char* end, OutputSink& sink, Decide decide, void* context)
+	{
+		Input input(begin, end);
+		return transcode(input, sink, decide, context);
+	}
+
+	bool Filter::runStream(std::istream& in, OutputSink& sink, Decide decide, void* context)
+	{
+		Input input(in);
+		return transcode(input, sink, decide, context);
+	}
+
+	// What the rules in active_ from activeBegin say about a value; kept is
+	// updated for its members.
+	Filter::Action Filter::decideRules(std::size_t activeBegin, bool& kept, bool isContainer,
+		std::string_view& replacement) const
+	{
+		bool replaced = false;
+		bool rulesBelow = false;
+		bool keptBelow = false;
+		for (std::size_t index = activeBegin; index < active_.size(); ++index)
+		{
+			const Rule& rule = *active_[index];
+			if (rule.action_ == actionDrop)
+				return actionDrop;
+			if (rule.action_ == actionReplace && !replaced)
+			{
+				replacement = rule.replacement_;
+				replaced = true;
+			}
+			kept = kept || rule.keep_;
+			keptBelow = keptBelow || rule.keepBelow_;
+			rulesBelow = rulesBelow || rule.hasChildren();
+		}
+		if (replaced)
+			return actionReplace;
+		if (!kept)
+			return keptBelow && isContainer ? actionDescend : actionDrop;
+		return rulesBelow && isContainer ? actionDescend : actionCopy;
+	}
+
+	bool Filter::transcode(Input& input, OutputSink& sink, Decide decide, void* context)
+	{
+		error_.clear();
+		frames_.clear();
+		steps_.clear();
+		active_.assign(1, root_.get());
+		std::size_t activeBegin = 0;	// of the rules of the value
+		bool kept = !keepMode_;
+		const char* key = 0;	// "<length>:<name>" of the member, in the window
+		std::size_t keyLength = 0;
+		Value replacement;
+		for (;;)
+		{
+			// the value at current(), with its rules in active_ from activeBegin
+			ValueType type;
+			if (!input.need(1) || !typeOf(*input.current(), type))
+				return fail(input, "value expected");
+			bool isContainer = type == listValue || type == dictValue;
+			bool valueKept = kept;
+			std::string_view replacementBytes;
+			Action action = decideRules(activeBegin, valueKept, isContainer, replacementBytes);
+			if (decide && (action == actionCopy || action == actionDescend))
+			{
+				action = decide(context, steps_, type, replacement);
+				if (action == actionReplace)
+				{
+					UInt length = writer_.write(replacement);
+					replacementBytes = std::string_view(writer_.getCString(), length);
+					if (replacement.type() == nullValue)
+						action = actionDrop;
+					replacement = Value();
+				}
+			}
+			if (action == actionDescend && !isContainer)
+				action = actionCopy;
+
+			if (action != actionDrop && key)
+				sink.write(key, keyLength);
+			if (action == actionDescend)
+			{
+				sink.put(type == dictValue ? 'd' : 'l');
+				input.advance(1);
+				Frame frame;
+				frame.isDict_ = type == dictValue;
+				frame.kept_ = valueKept;
+				frame.index_ = 0;
+				frame.activeBegin_ = activeBegin;
+				frame.activeEnd_ = active_.size();
+				frames_.push_back(frame);
+			}
+			else if (action == actionCopy)
+			{
+				input.beginCopy(sink);
+				bool ok = input.skipValue();
+				input.endCopy();
+				if (!ok)
+					return fail(input, "invalid value");
+			}
+			else
+			{
+				if (!input.skipValue())
+					return fail(input, "invalid value");
+				if (action == actionReplace)
+					sink.write(replacementBytes.data(), replacementBytes.length());
+			}
+
+			// move on to the next member, closing the containers that end
+			for (;;)
+			{
+				if (frames_.empty())
+				{
+					if (input.need(1))
+						return fail(input, "data after the end of the document");
+					return sink.flush();
+				}
+				Frame& frame = frames_.back();
+				if (!input.need(1))
+					return fail(input, "unexpected end of input");
+				if (*input.current() != 'e')
+					break;
+				input.advance(1);
+				sink.put('e');
+				active_.resize(frame.activeBegin_);
+				frames_.pop_back();
+				if (decide)
+					steps_.resize(frames_.size());
+			}
+			Frame& frame = frames_.back();
+			active_.resize(frame.activeEnd_);
+			activeBegin = active_.size();
+			kept = frame.kept_;
+			key = 0;
+			Step* step = 0;
+			if (decide)
+			{
+				steps_.resize(frames_.size());
+				step = &steps_.back();
+			}
+			if (frame.isDict_)
+			{
+				std::size_t prefixLength;
+				std::size_t length;
+				if (!input.peekLength(prefixLength, length) || !input.need(prefixLength + length + 1))
+					return fail(input, "member name expected");
+				key = input.current();
+				keyLength = prefixLength + length;
+				std::string_view name(key + prefixLength, length);
+				input.advance(keyLength);	// the window still holds the name and the first byte of the value
+				for (std::size_t index = frame.activeBegin_; index < frame.activeEnd_; ++index)
+				{
+					const Rule& rule = *active_[index];
+					auto it = rule.members_.find(name);
+					if (it != rule.members_.end())
+						active_.push_back(it->second.get());
+					if (rule.any_)
+						active_.push_back(rule.any_.get());
+				}
+				if (step)
+				{
+					step->key_.assign(name.data(), name.length());
+					step->isIndex_ = false;
+				}
+			}
+			else
+			{
+				ArrayIndex index = frame.index_++;
+				for (std::size_t rule = frame.activeBegin_; rule < frame.activeEnd_; ++rule)
+				{
+					auto it = active_[rule]->elements_.find(index);
+					if (it != active_[rule]->elements_.end())
+						active_.push_back(it->second.get());
+					if (active_[rule]->any_)
+						active_.push_back(active_[rule]->any_.get());
+				}
+				if (step)
+				{
+					step->key_.clear();
+					step->index_ = index;
+					step->isIndex_ = true;
+				}
+			}
+		}
+	}
+
+	bool Filter::fail(const Input& input, const char* message)
+	{
+		char offset[32];
+		snprintf(offset, sizeof(offset), "%llu", (unsigned long long)input.offset());
+		error_ = std::string("Offset ") + offset + ": " + message;
+		return false;
+	}
+
+} // namespace Bencode
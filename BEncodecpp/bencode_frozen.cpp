@@ -0,0 +1,400 @@
+#include "frozen.h"
+#include "traversal.h"
+#include <unordered_map>
+#include <string_view>
+#include <stdexcept>
+#include <algorithm>
+
+namespace Bencode {
+
+	// Block layout: one tag byte per node, followed by
+	// - tagInt: the zigzag varint value
+	// - tagString: the varint length and the bytes
+	// - tagStringRef: the varint index of an earlier tagString
+	// - tagList: the varint element count, then the elements
+	// - tagSparseList: for a list with missing indices, the varint member
+	//   count, then for each member the varint count of indices skipped
+	//   before it, then the members
+	// - tagDict: the varint member count, then for each member its name
+	//   (tagString or tagStringRef) and its value
+	enum FrozenTag
+	{
+		tagNull = 0,
+		tagInt,
+		tagString,
+		tagStringRef,
+		tagList,
+		tagDict,
+		tagSparseList
+	};
+
+	static std::atomic<FrozenValue::Counters*> frozenCounters(0);
+
+	// class FrozenValue::Encoder
+	// //////////////////////////////////////////////////////////////////
+
+	class FrozenValue::Encoder
+	{
+	public:
+		explicit Encoder(std::vector<unsigned char>& block)
+			: block_(block)
+		{
+		}
+
+		void visitNull(const Value&)
+		{
+			block_.push_back(tagNull);
+		}
+
+		void visitInt(const Value& node)
+		{
+			writeInt(node.asInt());
+		}
+
+		void visitString(const Value& node)
+		{
+			writeString(node.asStringView());
+		}
+
+		bool beginList(const Value& node)
+		{
+			if (!node.isPacked())
+			{
+				// size() is the last index + 1: only the members present are visited
+				unsigned long long count = 0;
+				for (Value::const_iterator it = node.begin(); it != node.end(); ++it)
+					++count;
+				if (count == node.size())
+				{
+					block_.push_back(tagList);
+					writeVarint(count);
+					return true;
+				}
+				block_.push_back(tagSparseList);
+				writeVarint(count);
+				UInt next = 0;
+				for (Value::const_iterator it = node.begin(); it != node.end(); ++it)
+				{
+					writeVarint(it.index() - next);
+					next = it.index() + 1;
+				}
+				return true;
+			}
+			block_.push_back(tagList);
+			writeVarint(node.size());
+			ArrayIndex size = ArrayIndex(node.size());
+			const Int* ints = node.packedInts();
+			for (ArrayIndex index = 0; index < size; ++index)
+			{
+				if (ints)
+					writeInt(ints[index]);
+				else
+					writeString(node.packedString(index));
+			}
+			return false;
+		}
+
+		bool beginDict(const Value& node)
+		{
+			block_.push_back(tagDict);
+			writeVarint(node.size());
+			return true;
+		}
+
+		void visitKey(std::string_view key)
+		{
+			writeString(key);
+		}
+
+		void endList(const Value&)
+		{
+		}
+
+		void endDict(const Value&)
+		{
+		}
+
+	private:
+		void writeInt(Int value)
+		{
+			long long zigzag = (long long)value;
+			block_.push_back(tagInt);
+			writeVarint((unsigned long long)(zigzag) << 1 ^ (unsigned long long)(zigzag >> 63));
+		}
+
+		void writeVarint(unsigned long long value)
+		{
+			while (value >= 0x80)
+			{
+				block_.push_back((unsigned char)(value | 0x80));
+				value >>= 7;
+			}
+			block_.push_back((unsigned char)value);
+		}
+
+		void writeString(std::string_view str)
+		{
+			std::pair<std::unordered_map<std::string_view, std::size_t>::iterator, bool> seen =
+				strings_.emplace(str, strings_.size());
+			if (!seen.second)
+			{
+				block_.push_back(tagStringRef);
+				writeVarint(seen.first->second);
+				return;
+			}
+			block_.push_back(tagString);
+			writeVarint(str.length());
+			block_.insert(block_.end(), str.begin(), str.end());
+		}
+
+		std::vector<unsigned char>& block_;
+		// views into the encoded tree, which outlives the encoder
+		std::unordered_map<std::string_view, std::size_t> strings_;
+	};
+
+	// class FrozenValue::Decoder
+	// //////////////////////////////////////////////////////////////////
+
+	class FrozenValue::Decoder
+	{
+	public:
+		explicit Decoder(const std::vector<unsigned char>& block)
+			: current_(block.empty() ? 0 : &block[0])
+			, end_(current_ + block.size())
+		{
+		}
+
+		/// Rebuild the tree into root, without recursion.
+		/// \throw std::runtime_error if the block is malformed.
+		void decode(Value& root)
+		{
+			class Frame
+			{
+			public:
+				Value* node_;
+				unsigned long long remaining_;
+				std::size_t indices_;	// offset of a sparse list's indices in indices_, or noIndices
+			};
+			std::vector<Frame> stack;
+			Value* target = &root;
+			for (;;)
+			{
+				if (target)
+				{
+					unsigned char tag = readByte();
+					switch (tag)
+					{
+					case tagNull:
+						*target = Value();
+						break;
+					case tagInt:
+					{
+						unsigned long long zigzag = readVarint();
+						*target = Value(Int((long long)(zigzag >> 1) ^ -(long long)(zigzag & 1)));
+						break;
+					}
+					case tagString:
+					case tagStringRef:
+						*target = readString(tag);
+						break;
+					case tagList:
+					case tagDict:
+					{
+						*target = Value(tag == tagList ? listValue : dictValue);
+						Frame frame = { target, readVarint(), noIndices };
+						stack.push_back(frame);
+						break;
+					}
+					case tagSparseList:
+					{
+						*target = Value(listValue);
+						Frame frame = { target, readVarint(), indices_.size() };
+						readIndices(frame.remaining_);
+						stack.push_back(frame);
+						break;
+					}
+					default:
+						malformed();
+					}
+					target = 0;
+				}
+				if (stack.empty())
+					break;
+				Frame& frame = stack.back();
+				if (frame.remaining_ == 0)
+				{
+					frame.node_->sealObject();	// complete: the members are no longer referenced
+					if (frame.indices_ != noIndices)
+						indices_.resize(frame.indices_);
+					stack.pop_back();
+					continue;
+				}
+				--frame.remaining_;
+				if (frame.indices_ != noIndices)
+				{
+					target = &(*frame.node_)[indices_[frame.indices_ + std::size_t(frame.remaining_)]];
+				}
+				else if (frame.node_->type() == listValue)
+				{
+					target = &frame.node_->append(Value());
+				}
+				else
+				{
+					unsigned char tag = readByte();
+					if (tag != tagString && tag != tagStringRef)
+						malformed();
+					Value key = readString(tag);
+					std::string_view name = key.asStringView();
+					target = &frame.node_->resolveReference(name.data(), UInt(name.length()), false);
+				}
+			}
+			if (current_ != end_)
+				malformed();
+		}
+
+	private:
+		static void malformed()
+		{
+			throw std::runtime_error("Bencode::FrozenValue: malformed block");
+		}
+
+		unsigned char readByte()
+		{
+			if (current_ == end_)
+				malformed();
+			return *current_++;
+		}
+
+		unsigned long long readVarint()
+		{
+			unsigned long long value = 0;
+			int shift = 0;
+			unsigned char byte;
+			do
+			{
+				if (shift > 63)
+					malformed();
+				byte = readByte();
+				value |= (unsigned long long)(byte & 0x7f) << shift;
+				shift += 7;
+			} while (byte & 0x80);
+			return value;
+		}
+
+		/// Read the count member indices of a sparse list, stored last to
+		/// first so that a member's index is found from the members left.
+		void readIndices(unsigned long long count)
+		{
+			if (count > (unsigned long long)(end_ - current_))
+				malformed();	// each index takes at least one byte
+			std::size_t first = indices_.size();
+			unsigned long long next = 0;
+			for (unsigned long long member = 0; member < count; ++member)
+			{
+				unsigned long long index = next + readVarint();
+				if (index < next || index > maxIndex)
+					malformed();
+				indices_.push_back(ArrayIndex(index));
+				next = index + 1;
+			}
+			std::reverse(indices_.begin() + first, indices_.end());
+		}
+
+		Value readString(unsigned char tag)
+		{
+			if (tag == tagStringRef)
+			{
+				unsigned long long index = readVarint();
+				if (index >= strings_.size())
+					malformed();
+				return strings_[std::size_t(index)];
+			}
+			unsigned long long length = readVarint();
+			if (length > (unsigned long long)(end_ - current_))
+				malformed();
+			const char* data = reinterpret_cast<const char*>(current_);
+			current_ += std::size_t(length);
+			// copies share the payload: repeated strings are stored once
+			strings_.push_back(Value(data, data + length));
+			return strings_.back();
+		}
+
+		static const std::size_t noIndices = std::size_t(-1);
+		// largest index a list member can have: size() must fit in UInt
+		static const unsigned long long maxIndex = 0xfffffffeull;
+
+		const unsigned char* current_;
+		const unsigned char* end_;
+		std::vector<Value> strings_;
+		std::vector<ArrayIndex> indices_;	// of the sparse lists being decoded, each last to first
+	};
+
+	// class FrozenValue
+	// //////////////////////////////////////////////////////////////////
+
+	void FrozenValue::setCounters(Counters* counters)
+	{
+		frozenCounters.store(counters, std::memory_order_relaxed);
+	}
+
+	FrozenValue::Counters* FrozenValue::counters()
+	{
+		return frozenCounters.load(std::memory_order_relaxed);
+	}
+
+	FrozenValue::FrozenValue()
+		: thawed_(true)
+	{
+	}
+
+	FrozenValue::FrozenValue(const Value& value)
+		: thawed_(false)
+	{
+		Encoder encoder(block_);
+		Traversal traversal;
+		traversal.traverse(value, encoder);
+		block_.shrink_to_fit();
+	}
+
+	const Value& FrozenValue::value() const
+	{
+		Counters* counters = frozenCounters.load(std::memory_order_relaxed);
+		if (!thawed_.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (!thawed_.load(std::memory_order_relaxed))
+			{
+				Decoder decoder(block_);
+				Value thawed;
+				decoder.decode(thawed);	// value_ stays null if the block is malformed
+				value_.swap(thawed);
+				thawed_.store(true, std::memory_order_release);
+				if (counters)
+					counters->misses_.fetch_add(1, std::memory_order_relaxed);
+				return value_;
+			}
+		}
+		if (counters)
+			counters->hits_.fetch_add(1, std::memory_order_relaxed);
+		return value_;
+	}
+
+	bool FrozenValue::isThawed() const
+	{
+		return thawed_.load(std::memory_order_acquire);
+	}
+
+	void FrozenValue::freeze()
+	{
+		if (block_.empty())
+			return;	// default constructed: null has no block to thaw
+		value_ = Value();
+		thawed_.store(false, std::memory_order_release);
+	}
+
+	std::size_t FrozenValue::frozenSize() const
+	{
+		return block_.size();
+	}
+
+} // namespace Bencode
@@ -0,0 +1,507 @@
+#include "query.h"
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+namespace Bencode {
+
+	// class Query::Parser
+	// //////////////////////////////////////////////////////////////////
+
+	class Query::Parser
+	{
+	public:
+		Parser(const std::string& expression)
+			: expression_(expression)
+			, current_(0)
+		{
+		}
+
+		void parse(Steps& steps)
+		{
+			while (!atEnd())
+			{
+				char c = expression_[current_];
+				if (c == '.')
+				{
+					++current_;
+					if (peek('.'))
+					{
+						++current_;
+						Step step = Step();
+						if (peek('*'))
+						{
+							++current_;
+							step.kind_ = Step::kindDescendantAll;
+						}
+						else
+						{
+							step.kind_ = Step::kindDescendantKey;
+							if (!readName(step.key_, ".["))
+								invalid("member name expected after '..'");
+						}
+						steps.push_back(step);
+					}
+					else if (peek('*'))
+					{
+						++current_;
+						Step step = Step();
+						step.kind_ = Step::kindWildcard;
+						steps.push_back(step);
+					}
+					else
+					{
+						Step step = Step();
+						step.kind_ = Step::kindKey;
+						if (readName(step.key_, ".["))
+							steps.push_back(step);
+					}
+				}
+				else if (c == '[')
+				{
+					++current_;
+					steps.push_back(Step());
+					readBracket(steps.back());
+				}
+				else
+				{
+					invalid("'.' or '[' expected");
+				}
+			}
+		}
+
+	private:
+		bool atEnd() const
+		{
+			return current_ == expression_.length();
+		}
+
+		bool peek(char c) const
+		{
+			return !atEnd() && expression_[current_] == c;
+		}
+
+		void expect(char c)
+		{
+			if (!peek(c))
+				invalid(std::string("'") + c + "' expected");
+			++current_;
+		}
+
+		void skipSpaces()
+		{
+			while (peek(' '))
+				++current_;
+		}
+
+		bool readName(std::string& name, const char* terminators)
+		{
+			std::string::size_type begin = current_;
+			while (!atEnd() && !strchr(terminators, expression_[current_]))
+				++current_;
+			name.assign(expression_, begin, current_ - begin);
+			return !name.empty();
+		}
+
+		bool readQuoted(std::string& text)
+		{
+			if (!peek('\'') && !peek('"'))
+				return false;
+			char quote = expression_[current_++];
+			std::string::size_type begin = current_;
+			while (!atEnd() && expression_[current_] != quote)
+				++current_;
+			if (atEnd())
+				invalid("unterminated string");
+			text.assign(expression_, begin, current_ - begin);
+			++current_;
+			return true;
+		}
+
+		bool readIndex(ArrayIndex& index)
+		{
+			if (atEnd() || expression_[current_] < '0' || expression_[current_] > '9')
+				return false;
+			index = 0;
+			for (; !atEnd() && expression_[current_] >= '0' && expression_[current_] <= '9'; ++current_)
+			{
+				ArrayIndex digit = ArrayIndex(expression_[current_] - '0');
+				if (index > (ArrayIndex(-1) - digit) / 10)
+					invalid("index out of range");
+				index = index * 10 + digit;
+			}
+			return true;
+		}
+
+		// after '['
+		void readBracket(Step& step)
+		{
+			if (peek('*'))
+			{
+				++current_;
+				step.kind_ = Step::kindWildcard;
+			}
+			else if (peek('?'))
+			{
+				++current_;
+				step.kind_ = Step::kindFilter;
+				readFilter(step);
+			}
+			else if (readQuoted(step.key_))
+			{
+				step.kind_ = Step::kindKey;
+			}
+			else if (readIndex(step.index_))
+			{
+				step.kind_ = Step::kindIndex;
+			}
+			else
+			{
+				invalid("index, '*', '?' or quoted name expected");
+			}
+			expect(']');
+		}
+
+		// after '[?'
+		void readFilter(Step& step)
+		{
+			expect('(');
+			skipSpaces();
+			if (peek('@'))
+				++current_;
+			while (peek('.') || peek('['))
+			{
+				Step relative = Step();
+				if (expression_[current_++] == '.')
+				{
+					relative.kind_ = Step::kindKey;
+					if (!readName(relative.key_, ".[=!<>) "))
+						invalid("member name expected in filter");
+				}
+				else
+				{
+					if (readQuoted(relative.key_))
+						relative.kind_ = Step::kindKey;
+					else if (readIndex(relative.index_))
+						relative.kind_ = Step::kindIndex;
+					else
+						invalid("index or quoted name expected in filter");
+					expect(']');
+				}
+				step.filterPath_.push_back(relative);
+			}
+			skipSpaces();
+			step.op_ = readOperator();
+			if (step.op_ != opExists)
+			{
+				skipSpaces();
+				readLiteral(step.literal_);
+				skipSpaces();
+			}
+			expect(')');
+		}
+
+		CompareOp readOperator()
+		{
+			static const struct
+			{
+				const char* token_;
+				CompareOp op_;
+			} operators[] = {
+				{ "==", opEqual }, { "!=", opNotEqual },
+				{ "<=", opLessEqual }, { ">=", opGreaterEqual },
+				{ "<", opLess }, { ">", opGreater }
+			};
+			for (std::size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i)
+			{
+				std::size_t length = strlen(operators[i].token_);
+				if (expression_.compare(current_, length, operators[i].token_) == 0)
+				{
+					current_ += length;
+					return operators[i].op_;
+				}
+			}
+			return opExists;
+		}
+
+		void readLiteral(Value& literal)
+		{
+			std::string text;
+			if (readQuoted(text))
+			{
+				literal = Value(text);
+				return;
+			}
+			bool isNegative = peek('-');
+			if (isNegative)
+				++current_;
+			if (atEnd() || expression_[current_] < '0' || expression_[current_] > '9')
+				invalid("integer or quoted string expected");
+			UInt limit = isNegative ? UInt(Value::maxInt) + 1 : UInt(Value::maxInt);
+			UInt value = 0;
+			for (; !atEnd() && expression_[current_] >= '0' && expression_[current_] <= '9'; ++current_)
+			{
+				UInt digit = UInt(expression_[current_] - '0');
+				if (value > (limit - digit) / 10)
+					invalid("integer out of range");
+				value = value * 10 + digit;
+			}
+			literal = isNegative ? Value(Int(0 - value)) : Value(Int(value));
+		}
+
+		void invalid(const std::string& message)
+		{
+			char position[16];
+			snprintf(position, sizeof(position), "%u", unsigned(current_));
+			throw std::runtime_error("Invalid query '" + expression_ + "' at position "
+				+ position + ": " + message);
+		}
+
+		const std::string& expression_;
+		std::string::size_type current_;
+	};
+
+	// class Query
+	// //////////////////////////////////////////////////////////////////
+
+	Query::Query(const std::string& expression)
+	{
+		Parser parser(expression);
+		parser.parse(steps_);
+	}
+
+	static bool storeFirst(void* context, std::size_t, const Value& node)
+	{
+		*static_cast<const Value**>(context) = &node;
+		return false;
+	}
+
+	const Value* Query::first(const Value& root) const
+	{
+		const Value* result = 0;
+		run(&root, 1, &storeFirst, &result);
+		return result;
+	}
+
+	void Query::run(const Value* roots, std::size_t count, Sink sink, void* context) const
+	{
+		Frames stack;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			if (!match(roots[i], i, sink, context, stack))
+				return;
+		}
+	}
+
+	void Query::runParallel(const Value* roots, std::size_t count, Sink sink, void* context,
+		unsigned int threadCount) const
+	{
+		if (threadCount == 0)
+			threadCount = std::thread::hardware_concurrency();
+		if (threadCount > count)
+			threadCount = unsigned(count);
+		if (threadCount <= 1)
+		{
+			run(roots, count, sink, context);
+			return;
+		}
+
+		std::vector<std::thread> workers;
+		workers.reserve(threadCount);
+		std::atomic<bool> failed(false);
+		std::mutex mutex;
+		std::exception_ptr error;	// the first one thrown, rethrown once all are joined
+		std::size_t chunk = count / threadCount;
+		std::size_t remainder = count % threadCount;
+		std::size_t begin = 0;
+		for (unsigned int t = 0; t < threadCount; ++t)
+		{
+			std::size_t end = begin + chunk + (t < remainder ? 1 : 0);
+			workers.push_back(std::thread([this, roots, begin, end, sink, context, &failed, &mutex, &error]()
+				{
+					try
+					{
+						Frames stack;
+						for (std::size_t i = begin; i < end && !failed.load(std::memory_order_relaxed); ++i)
+							match(roots[i], i, sink, context, stack);
+					}
+					catch (...)
+					{
+						failed.store(true, std::memory_order_relaxed);
+						std::lock_guard<std::mutex> lock(mutex);
+						if (!error)
+							error = std::current_exception();
+					}
+				}));
+			begin = end;
+		}
+		for (std::size_t t = 0; t < workers.size(); ++t)
+			workers[t].join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	bool Query::match(const Value& root, std::size_t rootIndex, Sink sink, void* context,
+		Frames& stack) const
+	{
+		stack.clear();
+		if (!enter(root, 0, rootIndex, sink, context, stack))
+			return false;
+		while (!stack.empty())
+		{
+			Frame& frame = stack.back();
+			std::size_t step = frame.step_;
+			const Step& current = steps_[step];
+			if (frame.lookupPending_)
+			{
+				frame.lookupPending_ = false;
+				const Value* child = frame.node_->find(current.key_);
+				// may grow stack: frame is not used past this point
+				if (child && !enter(*child, step + 1, rootIndex, sink, context, stack))
+					return false;
+				continue;
+			}
+			if (frame.current_ == frame.end_)
+			{
+				stack.pop_back();
+				continue;
+			}
+			const Value& child = *frame.current_;
+			++frame.current_;
+			switch (current.kind_)
+			{
+			case Step::kindDescendantKey:
+			case Step::kindDescendantAll:
+				// searched once the matches of child itself, pushed above it, are done
+				push(child, step, stack);
+				if (current.kind_ == Step::kindDescendantAll
+					&& !enter(child, step + 1, rootIndex, sink, context, stack))
+					return false;
+				break;
+			case Step::kindFilter:
+				if (test(child, current) && !enter(child, step + 1, rootIndex, sink, context, stack))
+					return false;
+				break;
+			default:
+				if (!enter(child, step + 1, rootIndex, sink, context, stack))
+					return false;
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool Query::enter(const Value& node, std::size_t step, std::size_t rootIndex,
+		Sink sink, void* context, Frames& stack) const
+	{
+		// key and index steps are followed in place; the others push node
+		const Value* current = &node;
+		for (; step < steps_.size(); ++step)
+		{
+			const Step& next = steps_[step];
+			if (next.kind_ == Step::kindKey)
+			{
+				current = current->find(next.key_);
+				if (!current)
+					return true;
+			}
+			else if (next.kind_ == Step::kindIndex)
+			{
+				if (current->type() != listValue)
+					return true;
+				current = &((*current)[next.index_]);
+				if (current == &Value::null)
+					return true;
+			}
+			else
+			{
+				push(*current, step, stack);
+				return true;
+			}
+		}
+		return sink(context, rootIndex, *current);
+	}
+
+	void Query::push(const Value& node, std::size_t step, Frames& stack) const
+	{
+		if (node.type() != listValue && node.type() != dictValue)
+			return;	// no children to match
+		Frame frame;
+		frame.node_ = &node;
+		frame.step_ = step;
+		frame.current_ = node.begin();
+		frame.end_ = node.end();
+		frame.lookupPending_ = steps_[step].kind_ == Step::kindDescendantKey;
+		stack.push_back(frame);
+	}
+
+	// An element of a packed list is copied into element rather than
+	// referenced, so that filters do not build the list's element nodes.
+	const Value* Query::resolveSimple(const Value& node, const Steps& path, Value& element)
+	{
+		const Value* current = &node;
+		for (Steps::const_iterator it = path.begin(); it != path.end(); ++it)
+		{
+			if (it->kind_ == Step::kindKey)
+			{
+				current = current->find(it->key_);
+				if (!current)
+					return 0;
+			}
+			else
+			{
+				if (current->type() != listValue)
+					return 0;
+				if (current->isPacked())
+				{
+					if (it->index_ >= current->size())
+						return 0;
+					element = current->get(it->index_, Value::null);
+					current = &element;
+					continue;
+				}
+				current = &((*current)[it->index_]);
+				if (current == &Value::null)
+					return 0;
+			}
+		}
+		return current;
+	}
+
+	bool Query::test(const Value& node, const Step& filter)
+	{
+		Value element;
+		const Value* operand = resolveSimple(node, filter.filterPath_, element);
+		if (!operand)
+			return false;
+		if (filter.op_ == opExists)
+			return true;
+		if (operand->type() != filter.literal_.type())
+			return filter.op_ == opNotEqual;
+
+		const Value& literal = filter.literal_;
+		switch (filter.op_)
+		{
+		case opEqual:
+			return *operand == literal;
+		case opNotEqual:
+			return *operand != literal;
+		case opLess:
+			return *operand < literal;
+		case opLessEqual:
+			return *operand <= literal;
+		case opGreater:
+			return *operand > literal;
+		case opGreaterEqual:
+			return *operand >= literal;
+		default:
+			break;
+		}
+		return false;
+	}
+
+} // namespace Bencode
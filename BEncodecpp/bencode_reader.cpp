@@ -6,6 +6,7 @@
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
+#include <limits>
 
 #if _MSC_VER >= 1400 // VC++ 8.0
 #pragma warning( disable : 4996 )   // disable warning about strdup being deprecated.
@@ -76,12 +77,48 @@ namespace Bencode {
         return result;
     }
 
-    Reader::Reader()
+    // Implementation of class Features
+    // ////////////////////////////////
+
+    Features::Features()
+        : internStrings_(false)
+        , shareSubtrees_(false)
+        , spillThreshold_(0)
+        , packLists_(false)
+        , keepEncoding_(false)
+    {
+    }
+
+    Features Features::all()
     {
+        return Features();
+    }
 
+    Features Features::cached()
+    {
+        Features features;
+        features.internStrings_ = true;
+        features.shareSubtrees_ = true;
+        return features;
     }
 
-    bool Reader::parse(const std::string& document, Value& root)
+    template<typename Traits>
+    BasicReader<Traits>::BasicReader()
+        : features_(Features::all())
+        , canonical_(false)
+    {
+
+    }
+
+    template<typename Traits>
+    BasicReader<Traits>::BasicReader(const Features& features)
+        : features_(features)
+        , canonical_(false)
+    {
+    }
+
+    template<typename Traits>
+    bool BasicReader<Traits>::parse(const std::string& document, Value& root)
     {
         document_ = document;
         const char* begin = document_.c_str();
@@ -89,7 +126,8 @@ namespace Bencode {
         return parse(begin, end, root);
     }
 
-    bool Reader::parse(const char* beginDoc, const char* endDoc, Value& root)
+    template<typename Traits>
+    bool BasicReader<Traits>::parse(const char* beginDoc, const char* endDoc, Value& root)
     {
         begin_ = beginDoc;
         end_ = endDoc;
@@ -100,8 +138,14 @@ namespace Bencode {
         while (!nodes_.empty())
             nodes_.pop();
         nodes_.push(&root);
+        subtrees_.clear();
+        sharingStats_ = SharingStats();
+        if (features_.keepEncoding_)
+            source_ = Value(beginDoc, endDoc);
 
         bool successful = readValue();
+        subtrees_.clear();
+        source_ = Value();
         Token token;
         readToken(token);
         if (!root.isList() && !root.isDict())
@@ -118,14 +162,16 @@ namespace Bencode {
         return successful;
     }
 
-    bool Reader::parse(std::istream& is, Value& root)
+    template<typename Traits>
+    bool BasicReader<Traits>::parse(std::istream& is, Value& root)
     {
         std::string doc;
         std::getline(is, doc, (char)EOF);
         return parse(doc, root);
     }
 
-    bool Reader::readValue()
+    template<typename Traits>
+    bool BasicReader<Traits>::readValue()
     {
         Token token;
         readToken(token);
@@ -137,9 +183,23 @@ namespace Bencode {
         {
         case tokenDictBegin:
             successful = readDict(token);
+            if (successful)
+                currentValue().sealObject();    // the members are no longer referenced
+            if (successful && canonical_ && features_.keepEncoding_)
+                keepEncoding(token);
+            if (successful && features_.shareSubtrees_)
+                shareSubtree(currentValue());
             break;
         case tokenListBegin:
             successful = readList(token);
+            if (successful)
+                currentValue().sealObject();
+            if (successful && features_.packLists_)
+                currentValue().pack();
+            if (successful && canonical_ && features_.keepEncoding_)
+                keepEncoding(token);
+            if (successful && features_.shareSubtrees_)
+                shareSubtree(currentValue());
             break;
         case tokenNumber:
             successful = decodeNumber(token);
@@ -154,21 +214,34 @@ namespace Bencode {
         return successful;
     }
 
-    bool Reader::readDict(Token& token)
+    template<typename Traits>
+    bool BasicReader<Traits>::readDict(Token& token)
     {
         Token tokenName;
         std::string name;
+        std::string previousName;
+        bool canonical = true;     // keys in strictly increasing byte order, members canonical
+        bool first = true;
         currentValue() = Value(dictValue);
         while (readToken(tokenName))
         {
             if (tokenName.type_ == tokenEnd)  // empty object
+            {
+                canonical_ = canonical;
                 return true;
+            }
             if (tokenName.type_ != tokenString)
                 break;
 
             name = "";
             if (!decodeString(tokenName, name))
                 return recoverFromError(tokenEnd);
+            if (canonical)
+            {
+                canonical = isCanonicalLength(tokenName) && (first || previousName < name);
+                previousName = name;
+                first = false;
+            }
 
             Value& value = currentValue()[name];
             nodes_.push(&value);
@@ -176,22 +249,25 @@ namespace Bencode {
             nodes_.pop();
             if (!ok) // error already set
                 return recoverFromError(tokenEnd);
-
+            canonical = canonical && canonical_;
         }
         return addErrorAndRecover("Missing '}' or object member name",
             tokenName,
             tokenEnd);
     }
 
-    bool Reader::readList(Token& token)
+    template<typename Traits>
+    bool BasicReader<Traits>::readList(Token& token)
     {
         currentValue() = Value(listValue);
+        canonical_ = true;
         if (*current_ == 'e') // empty array
         {
             Token endArray;
             readToken(endArray);
             return true;
         }
+        bool canonical = true;
         int index = 0;
         while (true)
         {
@@ -201,53 +277,111 @@ namespace Bencode {
             nodes_.pop();
             if (!ok) // error already set
                 return recoverFromError(tokenEnd);
+            canonical = canonical && canonical_;
 
             if (*current_ == 'e') {
                 ++current_;
                 break;
             }
+        }
+        canonical_ = canonical;
+        return true;
+    }
+
+    // The container just read, from token to current_, is in canonical form:
+    // its bytes are its encoding.
+    template<typename Traits>
+    void BasicReader<Traits>::keepEncoding(const Token& token)
+    {
+        currentValue().setEncoding(source_,
+            std::size_t(token.start_ - begin_),
+            std::size_t(current_ - token.start_));
+    }
+
+    // The length prefix of a string token has no sign and no leading zero.
+    template<typename Traits>
+    bool BasicReader<Traits>::isCanonicalLength(const Token& token)
+    {
+        Location current = token.start_;
+        if (*current == '0')
+            return current[1] == ':';
+        for (; *current != ':'; ++current)
+        {
+            if (*current < '0' || *current > '9')
+                return false;
         }
         return true;
     }
 
-    bool Reader::decodeNumber(Token& token)
+    template<typename Traits>
+    void BasicReader<Traits>::shareSubtree(Value& node)
+    {
+        // Children were shared before their parent completed, so the hash
+        // of node only folds the hashes cached on them.
+        ++sharingStats_.subtrees_;
+        std::pair<typename std::unordered_set<Value>::iterator, bool> inserted = subtrees_.insert(node);
+        if (inserted.second)
+            return;
+        ++sharingStats_.shared_;
+        // its children are already shared: only what node alone holds is freed
+        sharingStats_.bytesSaved_ += node.exclusiveMemoryUsage().total().bytes_;
+        node = *inserted.first;
+    }
+
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeNumber(Token& token)
     {
         Location current = token.start_;
         bool isNegative = *++current == '-';
         if (isNegative)
             ++current;
-        Value::UInt value = 0;
+        // no leading zero, no "-0", and few enough digits not to overflow
+        std::ptrdiff_t digits = token.end_ - 1 - current;
+        canonical_ = digits > 0 && digits <= std::numeric_limits<UInt>::digits10
+            && (*current != '0' || (digits == 1 && !isNegative));
+        UInt value = 0;
         while (current < token.end_ - 1)
         {
             Char c = *current++;
             if (c < '0' || c > '9')
                 return addError("'" + std::string(token.start_, token.end_) + "' is not a number.", token);
-            value = value * 10 + Value::UInt(c - '0');
+            value = value * 10 + UInt(c - '0');
         }
         if (isNegative)
-            currentValue() = -Value::Int(value);
-        else if (value <= Value::UInt(Value::maxInt))
-            currentValue() = Value::Int(value);
+            currentValue() = -Int(value);
+        else if (value <= UInt(Value::maxInt))
+            currentValue() = Int(value);
         else
             currentValue() = value;
+        if (value > UInt(Value::maxInt))
+            canonical_ = false;     // not stored as read
         return true;
     }
 
-    bool Reader::decodeString(Token& token)
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeString(Token& token)
     {
-        std::vector<char> decoded;
-        if (!decodeString(token, decoded))
-            return false;
-
-        currentValue() = { 
-            &decoded[0], 
-            decoded.size() 
-        };
-
+        // the token spans "<length>:<bytes>", already validated by readString():
+        // the bytes are copied once, straight from the document
+        canonical_ = isCanonicalLength(token);
+        Location data = token.start_;
+        while (*data != ':')
+            ++data;
+        ++data;
+        unsigned int length = (unsigned int)(token.end_ - data);
+
+        if (features_.spillThreshold_ != 0 && length >= features_.spillThreshold_)
+            currentValue() = Value::mappedString(data, length);
+        else if (features_.internStrings_)
+            currentValue() = BasicStringPool<Traits>::intern(data, length);
+        else
+            currentValue() = Value(data, data + length);
+
         return true;
     }
 
-    bool Reader::decodeString(Token& token, std::vector<char>& decoded)
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeString(Token& token, std::vector<char>& decoded)
     {
         Location current = token.start_; // read how many chars that need to read
         int n = 0;
@@ -262,7 +396,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::decodeString(Token& token, std::string& decoded)
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeString(Token& token, std::string& decoded)
     {
         Location current = token.start_; // skip '"'
         Location end = token.end_;      // do not include '"'
@@ -314,7 +449,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::decodeUnicodeCodePoint(Token& token, Location& current, Location end, unsigned int& unicode)
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeUnicodeCodePoint(Token& token, Location& current, Location end, unsigned int& unicode)
     {
         if (!decodeUnicodeEscapeSequence(token, current, end, unicode))
             return false;
@@ -339,7 +475,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::decodeUnicodeEscapeSequence(Token& token, Location& current, Location end, unsigned int& unicode)
+    template<typename Traits>
+    bool BasicReader<Traits>::decodeUnicodeEscapeSequence(Token& token, Location& current, Location end, unsigned int& unicode)
     {
         if (end - current < 4)
             return addError("Bad unicode escape sequence in string: four digits expected.", token, current);
@@ -360,7 +497,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::addError(const std::string& message, Token& token, Location extra)
+    template<typename Traits>
+    bool BasicReader<Traits>::addError(const std::string& message, Token& token, Location extra)
     {
         ErrorInfo info;
         info.token_ = token;
@@ -370,7 +508,8 @@ namespace Bencode {
         return false;
     }
 
-    bool Reader::recoverFromError(TokenType skipUntilToken)
+    template<typename Traits>
+    bool BasicReader<Traits>::recoverFromError(TokenType skipUntilToken)
     {
         int errorCount = int(errors_.size());
         Token skip;
@@ -385,13 +524,15 @@ namespace Bencode {
         return false;
     }
 
-    bool Reader::addErrorAndRecover(const std::string& message, Token& token, TokenType skipUntilToken)
+    template<typename Traits>
+    bool BasicReader<Traits>::addErrorAndRecover(const std::string& message, Token& token, TokenType skipUntilToken)
     {
         addError(message, token);
         return recoverFromError(skipUntilToken);
     }
 
-    bool Reader::expectToken(TokenType type, Token& token, const char* message)
+    template<typename Traits>
+    bool BasicReader<Traits>::expectToken(TokenType type, Token& token, const char* message)
     {
         readToken(token);
         if (token.type_ != type)
@@ -399,7 +540,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::readToken(Token& token)
+    template<typename Traits>
+    bool BasicReader<Traits>::readToken(Token& token)
     {
         token.start_ = current_;
         Char c = getNextChar();
@@ -447,7 +589,8 @@ namespace Bencode {
     }
 
 
-    bool Reader::match(Location pattern,
+    template<typename Traits>
+    bool BasicReader<Traits>::match(Location pattern,
             int patternLength)
     {
         if (end_ - current_ < patternLength)
@@ -460,7 +603,8 @@ namespace Bencode {
         return true;
     }
 
-    bool Reader::readString()
+    template<typename Traits>
+    bool BasicReader<Traits>::readString()
     {
         int n = 0;
         readNumber(n);
@@ -468,24 +612,31 @@ namespace Bencode {
         {
             return false;
         }
-        while (current_ != end_)
+        if (n > end_ - current_)
         {
-            if (n-- > 0) {
-                getNextChar();
-            }
-            else break;
+            current_ = end_;
+            return false;
         }
-        if (n > 0)return false;
+        current_ += n;  // skip the bytes in one step, large strings included
         return true;
     }
 
-    bool Reader::readNumber()
+    template<typename Traits>
+    bool BasicReader<Traits>::readNumber()
     {
-        int a = 0;
-        return readNumber(a);
+        // only skipped here: decodeNumber() converts the digits to the Int of the traits
+        --current_;
+        while (current_ != end_ && ((*current_ >= '0' && *current_ <= '9') || *current_ == '-'))
+            ++current_;
+        if (current_ != end_ && *current_ == 'e') {
+            ++current_;
+            return true;
+        }
+        return false;
     }
 
-    bool Reader::readNumber(int& num)
+    template<typename Traits>
+    bool BasicReader<Traits>::readNumber(int& num)
     {
         num = 0;
         --current_;
@@ -505,20 +656,23 @@ namespace Bencode {
         return false;
     }
 
-    Value&
-        Reader::currentValue()
+    template<typename Traits>
+    BasicValue<Traits>&
+        BasicReader<Traits>::currentValue()
     {
         return *(nodes_.top());
     }
 
-    Reader::Char Reader::getNextChar()
+    template<typename Traits>
+    typename BasicReader<Traits>::Char BasicReader<Traits>::getNextChar()
     {
         if (current_ == end_)
             return 0;
         return *current_++;
     }
 
-    void Reader::getLocationLineAndColumn(Location location, int& line, int& column) const
+    template<typename Traits>
+    void BasicReader<Traits>::getLocationLineAndColumn(Location location, int& line, int& column) const
     {
         Location current = begin_;
         Location lastLineStart = current;
@@ -544,7 +698,8 @@ namespace Bencode {
         ++line;
     }
 
-    std::string Reader::getLocationLineAndColumn(Location location) const
+    template<typename Traits>
+    std::string BasicReader<Traits>::getLocationLineAndColumn(Location location) const
     {
         int line, column;
         getLocationLineAndColumn(location, line, column);
@@ -553,10 +708,11 @@ namespace Bencode {
         return buffer;
     }
 
-    std::string Reader::getFormatedErrorMessages() const
+    template<typename Traits>
+    std::string BasicReader<Traits>::getFormatedErrorMessages() const
     {
         std::string formattedMessage;
-        for (Errors::const_iterator itError = errors_.begin();
+        for (typename Errors::const_iterator itError = errors_.begin();
             itError != errors_.end();
             ++itError)
         {
@@ -569,10 +725,17 @@ namespace Bencode {
         return formattedMessage;
     }
 
-    std::istream& operator>>(std::istream& sin, Value& root)
+    template<typename Traits>
+    const typename BasicReader<Traits>::SharingStats& BasicReader<Traits>::getSharingStats() const
+    {
+        return sharingStats_;
+    }
+
+    template<typename Traits>
+    std::istream& operator>>(std::istream& sin, BasicValue<Traits>& root)
     {
         // TODO: ڴ˴ return 
-        Bencode::Reader reader;
+        BasicReader<Traits> reader;
         bool ok = reader.parse(sin, root);
         //JSON_ASSERT( ok );
         if (!ok) throw std::runtime_error(reader.getFormatedErrorMessages());
@@ -597,4 +760,11 @@ namespace Bencode {
             return -1;
         }
     }
+
+    template class BasicReader<ValueTraits>;
+    template class BasicReader<TorrentValueTraits>;
+    template class BasicReader<KrpcValueTraits>;
+    template std::istream& operator>>(std::istream&, Value&);
+    template std::istream& operator>>(std::istream&, BasicValue<TorrentValueTraits>&);
+    template std::istream& operator>>(std::istream&, BasicValue<KrpcValueTraits>&);
 } // namespace Bencode
\ No newline at end of file
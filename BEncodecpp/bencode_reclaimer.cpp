@@ -0,0 +1,91 @@
+#include "reclaimer.h"
+#include <utility>
+
+namespace Bencode {
+
+	// class Reclaimer
+	// //////////////////////////////////////////////////////////////////
+
+	Reclaimer::Reclaimer(Mode mode)
+		: mode_(mode)
+		, inProgress_(0)
+		, stopping_(false)
+	{
+		if (mode_ == backgroundThread)
+			thread_ = std::thread(&Reclaimer::run, this);
+	}
+
+	Reclaimer::~Reclaimer()
+	{
+		if (thread_.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+			}
+			wakeUp_.notify_one();
+			thread_.join();
+		}
+		collect();
+	}
+
+	void Reclaimer::dispose(Value& value)
+	{
+		Value disposed(std::move(value));	// leaves value null
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			queue_.push_back(std::move(disposed));
+		}
+		if (mode_ == backgroundThread)
+			wakeUp_.notify_one();
+	}
+
+	void Reclaimer::collect()
+	{
+		std::vector<Value> batch;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			batch.swap(queue_);
+			inProgress_ += batch.size();
+		}
+		std::size_t count = batch.size();
+		batch.clear();	// destroys the trees outside the lock
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			inProgress_ -= count;
+		}
+		drained_.notify_all();
+	}
+
+	void Reclaimer::drain()
+	{
+		if (mode_ == deferred)
+		{
+			collect();
+			return;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		drained_.wait(lock, [this]() { return queue_.empty() && inProgress_ == 0; });
+	}
+
+	std::size_t Reclaimer::pending() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return queue_.size() + inProgress_;
+	}
+
+	void Reclaimer::run()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;)
+		{
+			wakeUp_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;	// stopping
+			lock.unlock();
+			collect();
+			lock.lock();
+		}
+	}
+
+} // namespace Bencode
@@ -0,0 +1,311 @@
+#include "sink.h"
+#include <ostream>
+#include <utility>
+#include <cerrno>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Bencode {
+
+	// class OutputSink
+	// //////////////////////////////////////////////////////////////////
+
+	OutputSink::OutputSink()
+		: begin_(0)
+		, current_(0)
+		, end_(0)
+		, failed_(false)
+		, referenceThreshold_(std::size_t(-1))
+	{
+	}
+
+	OutputSink::~OutputSink()
+	{
+	}
+
+	bool OutputSink::flush()
+	{
+		return !failed_;
+	}
+
+	void OutputSink::reference(const char* data, std::size_t length)
+	{
+		write(data, length);
+	}
+
+	// class BufferedSink
+	// //////////////////////////////////////////////////////////////////
+
+	BufferedSink::BufferedSink(std::size_t bufferSize)
+		: buffer_(bufferSize ? bufferSize : 1)
+	{
+		begin_ = current_ = &buffer_[0];
+		end_ = begin_ + buffer_.size();
+	}
+
+	bool BufferedSink::flush()
+	{
+		if (current_ != begin_ && !failed_)
+			failed_ = !drain(begin_, std::size_t(current_ - begin_));
+		current_ = begin_;
+		return !failed_;
+	}
+
+	void BufferedSink::overflow(const char* data, std::size_t length)
+	{
+		if (!flush())
+			return;
+		if (length < buffer_.size())
+		{
+			memcpy(current_, data, length);
+			current_ += length;
+		}
+		else
+		{
+			failed_ = !drain(data, length);	// too large to be worth a copy
+		}
+	}
+
+	// class FileDescriptorSink
+	// //////////////////////////////////////////////////////////////////
+
+	FileDescriptorSink::FileDescriptorSink(int fd, std::size_t bufferSize)
+		: BufferedSink(bufferSize)
+		, fd_(fd)
+	{
+	}
+
+	FileDescriptorSink::~FileDescriptorSink()
+	{
+		flush();
+	}
+
+	bool FileDescriptorSink::drain(const char* data, std::size_t length)
+	{
+		while (length)
+		{
+#if defined(_WIN32)
+			unsigned int chunk = length > 0x40000000 ? 0x40000000 : unsigned(length);
+			int written = _write(fd_, data, chunk);
+#else
+			ssize_t written = ::write(fd_, data, length);
+#endif
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			data += written;
+			length -= std::size_t(written);
+		}
+		return true;
+	}
+
+	// class FileSink
+	// //////////////////////////////////////////////////////////////////
+
+	FileSink::FileSink(FILE* file, std::size_t bufferSize)
+		: BufferedSink(bufferSize)
+		, file_(file)
+	{
+	}
+
+	FileSink::~FileSink()
+	{
+		flush();
+	}
+
+	bool FileSink::drain(const char* data, std::size_t length)
+	{
+		return fwrite(data, 1, length, file_) == length;
+	}
+
+	// class StreamSink
+	// //////////////////////////////////////////////////////////////////
+
+	StreamSink::StreamSink(std::ostream& stream, std::size_t bufferSize)
+		: BufferedSink(bufferSize)
+		, stream_(stream)
+	{
+	}
+
+	StreamSink::~StreamSink()
+	{
+		flush();
+	}
+
+	bool StreamSink::drain(const char* data, std::size_t length)
+	{
+		return bool(stream_.write(data, std::streamsize(length)));
+	}
+
+	// class BufferSink
+	// //////////////////////////////////////////////////////////////////
+
+	BufferSink::BufferSink(char* buffer, std::size_t capacity)
+		: dropped_(0)
+	{
+		begin_ = current_ = buffer;
+		end_ = buffer + capacity;
+	}
+
+	void BufferSink::overflow(const char*, std::size_t length)
+	{
+		// nothing more is stored once a write did not fit
+		end_ = current_;
+		dropped_ += length;
+		failed_ = true;
+	}
+
+	// class StringSink
+	// //////////////////////////////////////////////////////////////////
+
+	StringSink::StringSink()
+	{
+		attach(0);
+	}
+
+	bool StringSink::flush()
+	{
+		string_.resize(size());
+		attach(string_.size());
+		return true;
+	}
+
+	void StringSink::clear()
+	{
+		attach(0);
+	}
+
+	void StringSink::reserve(std::size_t capacity)
+	{
+		if (capacity <= string_.size())
+			return;
+		std::size_t used = size();
+		string_.resize(capacity);
+		attach(used);
+	}
+
+	char* StringSink::extend(std::size_t length)
+	{
+		reserve(size() + length);
+		char* extended = current_;
+		current_ += length;
+		return extended;
+	}
+
+	std::string StringSink::take()
+	{
+		flush();
+		std::string result;
+		result.swap(string_);
+		attach(0);
+		return result;
+	}
+
+	void StringSink::overflow(const char* data, std::size_t length)
+	{
+		std::size_t used = size();
+		std::size_t capacity = string_.size() * 2;
+		if (capacity < used + length)
+			capacity = used + length;
+		if (capacity < 256)
+			capacity = 256;
+		string_.resize(capacity);
+		attach(used);
+		memcpy(current_, data, length);
+		current_ += length;
+	}
+
+	// Point the window at the whole string, of which used bytes are written.
+	void StringSink::attach(std::size_t used)
+	{
+		begin_ = &string_[0];
+		current_ = begin_ + used;
+		end_ = begin_ + string_.size();
+	}
+
+	// class GatherSink
+	// //////////////////////////////////////////////////////////////////
+
+	GatherSink::GatherSink(std::size_t threshold)
+		: scratch_(256)
+		, runStart_(0)
+		, referenced_(0)
+	{
+		referenceThreshold_ = threshold ? threshold : 1;
+		begin_ = current_ = &scratch_[0];
+		end_ = begin_ + scratch_.size();
+	}
+
+	bool GatherSink::flush()
+	{
+		closeRun();
+		// the scratch buffer does not move any more: resolve the offsets
+		slices_.clear();
+		slices_.reserve(pieces_.size());
+		for (std::size_t index = 0; index < pieces_.size(); ++index)
+		{
+			const Piece& piece = pieces_[index];
+			IoSlice slice;
+			slice.iov_base = const_cast<char*>(piece.data_ ? piece.data_ : begin_ + piece.offset_);
+			slice.iov_len = piece.length_;
+			slices_.push_back(slice);
+		}
+		return true;
+	}
+
+	void GatherSink::clear()
+	{
+		pieces_.clear();
+		slices_.clear();
+		current_ = begin_;
+		runStart_ = 0;
+		referenced_ = 0;
+	}
+
+	void GatherSink::overflow(const char* data, std::size_t length)
+	{
+		std::size_t used = std::size_t(current_ - begin_);
+		std::size_t capacity = scratch_.size() * 2;
+		if (capacity < used + length)
+			capacity = used + length;
+		scratch_.resize(capacity);
+		begin_ = &scratch_[0];
+		current_ = begin_ + used;
+		end_ = begin_ + scratch_.size();
+		memcpy(current_, data, length);
+		current_ += length;
+	}
+
+	void GatherSink::reference(const char* data, std::size_t length)
+	{
+		closeRun();
+		Piece piece;
+		piece.data_ = data;
+		piece.offset_ = 0;
+		piece.length_ = length;
+		pieces_.push_back(piece);
+		referenced_ += length;
+	}
+
+	// End the run of scratch bytes written since the last piece.
+	void GatherSink::closeRun()
+	{
+		std::size_t used = std::size_t(current_ - begin_);
+		if (used == runStart_)
+			return;
+		Piece piece;
+		piece.data_ = 0;
+		piece.offset_ = runStart_;
+		piece.length_ = used - runStart_;
+		pieces_.push_back(piece);
+		runStart_ = used;
+	}
+
+} // namespace Bencode
@@ -1,12 +1,31 @@
 #include <iostream>
 #include "value.h"
 #include "writer.h"
+#include "traversal.h"
 #include <utility>
 #include <stdexcept>
 #include <cstring>
 #include <cassert>
+#include <atomic>
+#include <cstdint>
 
 #include <cstddef>		// size_t
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <tuple>
+#include <new>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #define BENCODE_ASSERT_UNREACHABLE assert(false)
 #define BENCODE_ASSERT(condition) assert(condition);	// @todo <= change this into an exception throw
@@ -14,25 +33,181 @@
 
 namespace Bencode {
 
-	const Value Value::null;
-	const Int Value::minInt = Int(~(UInt(-1) / 2));
-	const Int Value::maxInt = Int(UInt(-1) / 2);
-	const UInt Value::maxUInt = UInt(-1);
+	template<typename Traits>
+	const BasicValue<Traits> BasicValue<Traits>::null;
+	template<typename Traits>
+	const typename BasicValue<Traits>::Int BasicValue<Traits>::minInt = Int(~(UInt(-1) / 2));
+	template<typename Traits>
+	const typename BasicValue<Traits>::Int BasicValue<Traits>::maxInt = Int(UInt(-1) / 2);
+	template<typename Traits>
+	const typename BasicValue<Traits>::UInt BasicValue<Traits>::maxUInt = UInt(-1);
 
 	ValueAllocator::~ValueAllocator()
 	{
 	}
 
-	class DefaultValueAllocator : public ValueAllocator
+	static std::atomic<ValueAllocator::Counters*> allocationCounters(0);
+
+	void ValueAllocator::setCounters(Counters* counters)
+	{
+		allocationCounters.store(counters, std::memory_order_release);
+	}
+
+	ValueAllocator::Counters* ValueAllocator::counters()
+	{
+		return allocationCounters.load(std::memory_order_acquire);
+	}
+
+	static inline void countAllocation(std::size_t size)
+	{
+		ValueAllocator::Counters* counters = allocationCounters.load(std::memory_order_acquire);
+		if (counters)
+		{
+			counters->bytes_.fetch_add((long long)size, std::memory_order_relaxed);
+			counters->allocations_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	static inline void countRelease(std::size_t size)
+	{
+		ValueAllocator::Counters* counters = allocationCounters.load(std::memory_order_acquire);
+		if (counters)
+		{
+			counters->bytes_.fetch_sub((long long)size, std::memory_order_relaxed);
+			counters->allocations_.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	void* allocateValueNode(std::size_t size)
+	{
+		countAllocation(size);
+		return ::operator new(size);
+	}
+
+	void releaseValueNode(void* node, std::size_t size)
+	{
+		countRelease(size);
+		::operator delete(node);
+	}
+
+	// class ValueArena
+	// //////////////////////////////////////////////////////////////////
+
+	/* Bump allocator holding a compacted subtree. Payloads placed with
+	 * allocateOwned() keep the arena alive until they are released; member
+	 * nodes and names belong to a payload and are never released one by one.
+	 * All the chunks are freed together, once the compaction is over and the
+	 * last payload is gone.
+	 */
+	class ValueArena
+	{
+	public:
+		ValueArena()
+			: next_(0)
+			, remaining_(0)
+			, live_(1)
+		{
+		}
+
+		void* allocate(std::size_t size)
+		{
+			size = (size + alignment - 1) & ~(alignment - 1);
+			if (size > remaining_)
+			{
+				if (size > chunkSize / 4)
+					return addChunk(size);	// keep filling the current chunk
+				next_ = addChunk(chunkSize);
+				remaining_ = chunkSize;
+			}
+			char* block = next_;
+			next_ += size;
+			remaining_ -= size;
+			return block;
+		}
+
+		/// Block keeping the arena alive until it is given to releaseOwned().
+		void* allocateOwned(std::size_t size)
+		{
+			char* block = static_cast<char*>(allocate(alignment + size));
+			live_.fetch_add(1, std::memory_order_relaxed);
+			*reinterpret_cast<ValueArena**>(block) = this;
+			return block + alignment;
+		}
+
+		static void releaseOwned(void* block)
+		{
+			(*reinterpret_cast<ValueArena**>(static_cast<char*>(block) - alignment))->release();
+		}
+
+		/// End of the compaction: from now on the arena lives as long as its payloads.
+		void seal()
+		{
+			release();
+		}
+
+	private:
+		static const std::size_t alignment = alignof(std::max_align_t);
+		static const std::size_t chunkSize = 64 * 1024;
+
+		~ValueArena()
+		{
+			for (std::size_t index = 0; index < chunks_.size(); ++index)
+			{
+				countRelease(chunks_[index].second);
+				::operator delete(chunks_[index].first);
+			}
+		}
+
+		char* addChunk(std::size_t size)
+		{
+			chunks_.reserve(chunks_.size() + 1);
+			char* chunk = static_cast<char*>(::operator new(size));
+			countAllocation(size);
+			chunks_.push_back(std::make_pair(chunk, size));
+			return chunk;
+		}
+
+		void release()
+		{
+			if (live_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete this;
+		}
+
+		std::vector<std::pair<char*, std::size_t> > chunks_;
+		char* next_;
+		std::size_t remaining_;
+		std::atomic<std::size_t> live_;	// owned blocks, plus one until seal()
+	};
+
+	void* allocateArenaNode(ValueArena* arena, std::size_t size)
+	{
+		return arena->allocate(size);
+	}
+
+	template<typename T>
+	static ValueNodeAllocator<T> arenaNodeAllocator(ValueArena* arena, const ValueNodeAllocator<T>*)
+	{
+		return ValueNodeAllocator<T>(arena);
+	}
+
+	// other node allocators can not place the nodes in the arena
+	template<typename Allocator>
+	static Allocator arenaNodeAllocator(ValueArena*, const Allocator*)
+	{
+		return Allocator();
+	}
+
+	class DefaultValueAllocator final : public ValueAllocator
 	{
 	public:
 		virtual ~DefaultValueAllocator()
 		{
 		}
 
-		virtual char* makeMemberName(const char* memberName)
+		virtual char* makeMemberName(const char* memberName,
+			unsigned int length = unknown)
 		{
-			return duplicateStringValue(memberName);
+			return duplicateStringValue(memberName, length);
 		}
 
 		virtual void releaseMemberName(char* memberName)
@@ -76,73 +251,1252 @@ namespace Bencode {
 		}
 	} dummyValueAllocatorInitializer;
 
+	// class AllocatorStrings
+	// //////////////////////////////////////////////////////////////////
+
+	char* AllocatorStrings::makeMemberName(const char* memberName, unsigned int length)
+	{
+		return valueAllocator()->makeMemberName(memberName, length);
+	}
+
+	void AllocatorStrings::releaseMemberName(char* memberName)
+	{
+		valueAllocator()->releaseMemberName(memberName);
+	}
+
+	char* AllocatorStrings::duplicateStringValue(const char* value, unsigned int length)
+	{
+		return valueAllocator()->duplicateStringValue(value, length);
+	}
+
+	void AllocatorStrings::releaseStringValue(char* value)
+	{
+		valueAllocator()->releaseStringValue(value);
+	}
+
 #include "bencode_valueiterator.inl"
 
-	Value::CZString::CZString(int index)
+	template<typename Traits>
+	BasicValue<Traits>::CZString::CZString(int index)
 		: cstr_(0)
 		, index_(index)
+		, length_(0)
 	{
 	}
-	Value::CZString::CZString(const char* cstr, DuplicationPolicy allocate)
-		: cstr_(allocate == duplicate ? valueAllocator()->makeMemberName(cstr)
+	template<typename Traits>
+	BasicValue<Traits>::CZString::CZString(const char* cstr, DuplicationPolicy allocate)
+		: CZString(cstr, UInt(strlen(cstr)), allocate)
+	{
+	}
+	template<typename Traits>
+	BasicValue<Traits>::CZString::CZString(const char* cstr, UInt length, DuplicationPolicy allocate)
+		: cstr_(allocate == duplicate ? Traits::Strings::makeMemberName(cstr, length)
 			: cstr)
 		, index_(allocate)
+		, length_(length)
 	{
+		if (allocate == duplicate)
+			countAllocation(length + 1);
 	}
-	Value::CZString::CZString(const CZString& other)
+	template<typename Traits>
+	BasicValue<Traits>::CZString::CZString(const CZString& other)
 		: cstr_(other.index_ != noDuplication && other.cstr_ != 0
-			? valueAllocator()->makeMemberName(other.cstr_)
+			? Traits::Strings::makeMemberName(other.cstr_, other.length_)
 			: other.cstr_)
 		, index_(other.cstr_ ? (other.index_ == noDuplication ? noDuplication : duplicate)
 			: other.index_)
+		, length_(other.length_)
 	{
+		if (index_ == duplicate && cstr_)
+			countAllocation(length_ + 1);
 	}
-	Value::CZString::~CZString()
+	template<typename Traits>
+	BasicValue<Traits>::CZString::~CZString()
 	{
 		if (cstr_ && index_ == duplicate)
-			valueAllocator()->releaseMemberName(const_cast<char*>(cstr_));
+		{
+			countRelease(length_ + 1);
+			Traits::Strings::releaseMemberName(const_cast<char*>(cstr_));
+		}
 	}
-	Value::CZString& Value::CZString::operator=(const CZString& other)
+	template<typename Traits>
+	typename BasicValue<Traits>::CZString& BasicValue<Traits>::CZString::operator=(const CZString& other)
 	{
 		// TODO: ڴ˴ return 
 		CZString temp(other);
 		swap(temp);
 		return *this;
 	}
-	bool Value::CZString::operator<(const CZString& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::CZString::operator<(const CZString& other) const
 	{
 		if (cstr_)
-			return strcmp(cstr_, other.cstr_) < 0;
+		{
+			// raw byte order, as required for bencode dict keys
+			UInt minLength = length_ < other.length_ ? length_ : other.length_;
+			int comp = memcmp(cstr_, other.cstr_, minLength);
+			if (comp != 0)
+				return comp < 0;
+			return length_ < other.length_;
+		}
 		return index_ < other.index_;
 	}
-	bool Value::CZString::operator==(const CZString& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::CZString::operator==(const CZString& other) const
 	{
 		if (cstr_)
-			return strcmp(cstr_, other.cstr_) == 0;
+			return length_ == other.length_
+				&& memcmp(cstr_, other.cstr_, length_) == 0;
 		return index_ == other.index_;
 	}
-	int Value::CZString::index() const
+	template<typename Traits>
+	int BasicValue<Traits>::CZString::index() const
 	{
 		return index_;
 	}
-	const char* Value::CZString::c_str() const
+	template<typename Traits>
+	const char* BasicValue<Traits>::CZString::c_str() const
 	{
 		return cstr_;
 	}
-	bool Value::CZString::isStaticString() const
+	template<typename Traits>
+	typename BasicValue<Traits>::UInt BasicValue<Traits>::CZString::length() const
+	{
+		return length_;
+	}
+	template<typename Traits>
+	bool BasicValue<Traits>::CZString::isStaticString() const
 	{
 		return index_ == noDuplication;
 	}
-	void Value::CZString::swap(CZString& other)
+	template<typename Traits>
+	void BasicValue<Traits>::CZString::swap(CZString& other)
+	{
+		std::swap(cstr_, other.cstr_);
+		std::swap(index_, other.index_);
+		std::swap(length_, other.length_);
+	}
+
+	// Content hashing
+	// //////////////////////////////////////////////////////////////////
+	//
+	// XXH64-style hashing. Strings are hashed over their bytes; containers
+	// fold in the hashes of their keys and values in canonical (sorted)
+	// order, so two values hash equal whenever they encode to the same
+	// bencode.
+
+	static const std::uint64_t hashPrime1 = 0x9E3779B185EBCA87ULL;
+	static const std::uint64_t hashPrime2 = 0xC2B2AE3D27D4EB4FULL;
+	static const std::uint64_t hashPrime3 = 0x165667B19E3779F9ULL;
+	static const std::uint64_t hashPrime4 = 0x85EBCA77C2B2AE63ULL;
+	static const std::uint64_t hashPrime5 = 0x27D4EB2F165667C5ULL;
+
+	static inline std::uint64_t hashRotl(std::uint64_t x, int r)
+	{
+		return (x << r) | (x >> (64 - r));
+	}
+
+	static inline std::uint64_t hashRead64(const unsigned char* p)
+	{
+		std::uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static inline std::uint64_t hashRead32(const unsigned char* p)
+	{
+		std::uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static inline std::uint64_t hashRound(std::uint64_t acc, std::uint64_t input)
+	{
+		acc += input * hashPrime2;
+		acc = hashRotl(acc, 31);
+		return acc * hashPrime1;
+	}
+
+	static inline std::uint64_t hashMerge(std::uint64_t acc, std::uint64_t value)
+	{
+		acc ^= hashRound(0, value);
+		return acc * hashPrime1 + hashPrime4;
+	}
+
+	static inline std::uint64_t hashAvalanche(std::uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= hashPrime2;
+		h ^= h >> 29;
+		h *= hashPrime3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	static std::uint64_t hashBytes(const char* data, std::size_t length, std::uint64_t seed)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		const unsigned char* end = p + length;
+		std::uint64_t h;
+		if (length >= 32)
+		{
+			const unsigned char* limit = end - 32;
+			std::uint64_t v1 = seed + hashPrime1 + hashPrime2;
+			std::uint64_t v2 = seed + hashPrime2;
+			std::uint64_t v3 = seed;
+			std::uint64_t v4 = seed - hashPrime1;
+			do
+			{
+				v1 = hashRound(v1, hashRead64(p));
+				v2 = hashRound(v2, hashRead64(p + 8));
+				v3 = hashRound(v3, hashRead64(p + 16));
+				v4 = hashRound(v4, hashRead64(p + 24));
+				p += 32;
+			} while (p <= limit);
+			h = hashRotl(v1, 1) + hashRotl(v2, 7) + hashRotl(v3, 12) + hashRotl(v4, 18);
+			h = hashMerge(h, v1);
+			h = hashMerge(h, v2);
+			h = hashMerge(h, v3);
+			h = hashMerge(h, v4);
+		}
+		else
+		{
+			h = seed + hashPrime5;
+		}
+		h += std::uint64_t(length);
+		for (; p + 8 <= end; p += 8)
+			h = hashRotl(h ^ hashRound(0, hashRead64(p)), 27) * hashPrime1 + hashPrime4;
+		if (p + 4 <= end)
+		{
+			h = hashRotl(h ^ (hashRead32(p) * hashPrime1), 23) * hashPrime2 + hashPrime3;
+			p += 4;
+		}
+		for (; p < end; ++p)
+			h = hashRotl(h ^ (*p * hashPrime5), 11) * hashPrime1;
+		return hashAvalanche(h);
+	}
+
+	// one seed per value type, so that e.g. i0e and 0: differ
+	static const std::uint64_t hashSeedNull = 0;
+	static const std::uint64_t hashSeedInt = 'i';
+	static const std::uint64_t hashSeedString = 's';
+	static const std::uint64_t hashSeedList = 'l';
+	static const std::uint64_t hashSeedDict = 'd';
+
+	// A hash that depends on a member handed out by non-const reference is
+	// cached with the mutation epoch it was computed in, and only trusted
+	// while the epoch is unchanged: the member may change through that
+	// reference without the nodes above it knowing. The epoch is only
+	// bumped by mutations that follow the caching of such a hash, so that
+	// building a tree does not write to it.
+	static std::atomic<std::uint64_t> mutationEpoch(1);
+	static std::atomic<bool> mutationEpochUsed(false);
+
+	static inline void noteMutation()
+	{
+		if (!mutationEpochUsed.load(std::memory_order_relaxed))
+			return;
+		mutationEpochUsed.store(false, std::memory_order_relaxed);
+		mutationEpoch.fetch_add(1, std::memory_order_release);
+	}
+
+	// class Value::StringRep
+	// class Value::ObjectRep
+	// //////////////////////////////////////////////////////////////////
+
+	// Copy value[0..length) and a terminating zero into a temporary file and
+	// map it read-only. The file is already unlinked (or deleted on close):
+	// it goes away with the mapping. Return 0 on failure.
+	static char* mapTemporaryString(const char* value, std::size_t length)
+	{
+#if defined(_WIN32)
+		char directory[MAX_PATH + 1];
+		char path[MAX_PATH + 1];
+		if (!GetTempPathA(sizeof(directory), directory) || !GetTempFileNameA(directory, "bnc", 0, path))
+			return 0;
+		HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			DeleteFileA(path);
+			return 0;
+		}
+		const char terminator = 0;
+		DWORD written = 0;
+		bool ok = WriteFile(file, value, DWORD(length), &written, 0) && written == length
+			&& WriteFile(file, &terminator, 1, &written, 0) && written == 1;
+		HANDLE mapping = ok ? CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0) : 0;
+		void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		return static_cast<char*>(data);
+#else
+		FILE* file = tmpfile();
+		if (!file)
+			return 0;
+		bool ok = fwrite(value, 1, length, file) == length && fputc(0, file) != EOF && fflush(file) == 0;
+		void* data = ok ? mmap(0, length + 1, PROT_READ, MAP_SHARED, fileno(file), 0) : MAP_FAILED;
+		fclose(file);
+		return data == MAP_FAILED ? 0 : static_cast<char*>(data);
+#endif
+	}
+
+	static void unmapTemporaryString(char* data, std::size_t length)
+	{
+#if defined(_WIN32)
+		(void)length;
+		UnmapViewOfFile(data);
+#else
+		munmap(data, length + 1);
+#endif
+	}
+
+	template<typename Traits>
+	struct BasicValue<Traits>::StringRep
+	{
+		enum Storage
+		{
+			storageHeap = 0,	// from the ValueAllocator
+			storageStatic,		// not owned (StaticString)
+			storageMapped,		// temporary file mapped in memory
+			storageArena		// next to the rep, in a ValueArena
+		};
+
+		static StringRep* make(const char* value, UInt length)
+		{
+			StringRep* rep = new StringRep;
+			rep->refCount_ = 1;
+			rep->length_ = length;
+			rep->data_ = Traits::Strings::duplicateStringValue(value, length);
+			rep->storage_ = storageHeap;
+			rep->pooled_ = false;
+			countAllocation(length + 1);
+			return rep;
+		}
+
+		static StringRep* makeStatic(const char* value)
+		{
+			StringRep* rep = new StringRep;
+			rep->refCount_ = 1;
+			rep->length_ = UInt(strlen(value));
+			rep->data_ = const_cast<char*>(value);
+			rep->storage_ = storageStatic;
+			rep->pooled_ = false;
+			return rep;
+		}
+
+		static StringRep* makeMapped(const char* value, UInt length)
+		{
+			char* data = mapTemporaryString(value, length);
+			if (!data)
+				return make(value, length);
+			StringRep* rep = new StringRep;
+			rep->refCount_ = 1;
+			rep->length_ = length;
+			rep->data_ = data;
+			rep->storage_ = storageMapped;
+			rep->pooled_ = false;
+			return rep;
+		}
+
+		static StringRep* makeInArena(ValueArena& arena, const char* value, UInt length)
+		{
+			StringRep* rep = ::new (arena.allocateOwned(sizeof(StringRep) + length + 1)) StringRep;
+			rep->refCount_ = 1;
+			rep->length_ = length;
+			rep->data_ = reinterpret_cast<char*>(rep + 1);
+			memcpy(rep->data_, value, length);
+			rep->data_[length] = 0;
+			rep->storage_ = storageArena;
+			rep->pooled_ = false;
+			return rep;
+		}
+
+		StringRep* retain()
+		{
+			refCount_.fetch_add(1, std::memory_order_relaxed);
+			return this;
+		}
+
+		void release()
+		{
+			if (refCount_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+			if (pooled_)
+				BasicStringPool<Traits>::forget(this);
+			if (storage_ == storageHeap)
+			{
+				countRelease(length_ + 1);
+				Traits::Strings::releaseStringValue(data_);
+			}
+			else if (storage_ == storageMapped)
+			{
+				unmapTemporaryString(data_, length_);
+			}
+			else if (storage_ == storageArena)
+			{
+				this->~StringRep();
+				ValueArena::releaseOwned(this);
+				return;
+			}
+			delete this;
+		}
+
+		static void* operator new(std::size_t size)
+		{
+			countAllocation(size);
+			return ::operator new(size);
+		}
+
+		static void operator delete(void* p, std::size_t size)
+		{
+			countRelease(size);
+			::operator delete(p);
+		}
+
+		std::atomic<int> refCount_;
+		UInt length_;
+		char* data_;
+		Storage storage_;
+		bool pooled_;	// registered in the StringPool
+	};
+
+	template<typename Traits>
+	struct BasicValue<Traits>::PackedList
+	{
+		PackedList()
+			: type_(nullValue)
+			, size_(0)
+			, stride_(0)
+		{
+		}
+
+		/// Copies the arrays only: other's elements_ may be under construction.
+		PackedList(const PackedList& other)
+			: type_(other.type_)
+			, size_(other.size_)
+			, stride_(other.stride_)
+			, ints_(other.ints_)
+			, bytes_(other.bytes_)
+			, offsets_(other.offsets_)
+		{
+		}
+
+		std::string_view string(ArrayIndex index) const
+		{
+			if (offsets_.empty())
+				return stride_ ? std::string_view(&bytes_[std::size_t(index) * stride_], stride_) : std::string_view("", 0);
+			return std::string_view(bytes_.data() + offsets_[index], offsets_[index + 1] - offsets_[index]);
+		}
+
+		Value element(ArrayIndex index) const
+		{
+			if (type_ == intValue)
+				return Value(ints_[index]);
+			std::string_view str = string(index);
+			return Value(str.data(), UInt(str.length()));
+		}
+
+		void buildElements()
+		{
+			elements_.reserve(size_);
+			for (ArrayIndex index = 0; index < size_; ++index)
+				elements_.push_back(element(index));
+		}
+
+		/// The elements as members, taken from elements_ when it is built.
+		void unpackInto(ObjectValues& map)
+		{
+			for (ArrayIndex index = 0; index < size_; ++index)
+			{
+				if (elements_.empty())
+					map.emplace_hint(map.end(), CZString(index), element(index));
+				else
+					map.emplace_hint(map.end(), CZString(index), std::move(elements_[index]));
+			}
+		}
+
+		/// Insert value before element index if it has the type of the
+		/// elements; false, and nothing done, otherwise.
+		bool insert(ArrayIndex index, const Value& value)
+		{
+			if (value.type() != type_)
+				return false;
+			if (type_ == intValue)
+			{
+				ints_.insert(ints_.begin() + index, value.asInt());
+			}
+			else
+			{
+				std::string_view str = value.asStringView();
+				if (offsets_.empty() && str.length() != stride_)
+				{
+					// the lengths differ from now on
+					offsets_.reserve(size_ + 2);
+					for (ArrayIndex offset = 0; offset <= size_; ++offset)
+						offsets_.push_back(std::size_t(offset) * stride_);
+					stride_ = 0;
+				}
+				if (offsets_.empty())
+				{
+					bytes_.insert(bytes_.begin() + std::size_t(index) * stride_, str.begin(), str.end());
+				}
+				else
+				{
+					std::size_t offset = offsets_[index];
+					bytes_.insert(bytes_.begin() + offset, str.begin(), str.end());
+					offsets_.insert(offsets_.begin() + index, offset);
+					for (ArrayIndex next = index + 1; next <= size_ + 1; ++next)
+						offsets_[next] += str.length();
+				}
+			}
+			++size_;
+			elements_.clear();
+			return true;
+		}
+
+		ValueType type_;	// of every element: intValue or stringValue
+		ArrayIndex size_;
+		UInt stride_;	// common length of the strings when offsets_ is empty
+		std::vector<Int> ints_;
+		std::vector<char> bytes_;	// the strings, back to back
+		std::vector<std::size_t> offsets_;	// size_ + 1 string offsets in bytes_, when the lengths differ
+		std::vector<Value> elements_;	// see ObjectRep::elements()
+	};
+
+	template<typename Traits>
+	struct BasicValue<Traits>::ObjectRep
+	{
+		typedef std::vector<const typename ObjectValues::value_type*> Slots;
+
+		enum PackedState
+		{
+			stateGeneral = 0,	// map_ only
+			statePacked,		// packed_ only
+			stateUnpacking,		// a reader is building packed_->elements_
+			stateBoth			// packed_ with its elements_ built
+		};
+
+		ObjectRep()
+			: refCount_(1)
+			, inArena_(false)
+			, exposed_(false)
+			, hash_(0)
+			, hashEpoch_(0)
+			, slots_(0)
+			, lookups_(0)
+			, packed_(0)
+			, packedState_(stateGeneral)
+			, source_(0)
+			, encodedOffset_(0)
+			, encodedLength_(0)
+		{
+		}
+
+		/// Empty payload whose nodes are allocated in arena (the rep itself is placed by the caller).
+		explicit ObjectRep(ValueArena* arena)
+			: refCount_(1)
+			, inArena_(true)
+			, exposed_(false)
+			, hash_(0)
+			, hashEpoch_(0)
+			, slots_(0)
+			, lookups_(0)
+			, packed_(0)
+			, packedState_(stateGeneral)
+			, source_(0)
+			, encodedOffset_(0)
+			, encodedLength_(0)
+			, map_(std::less<CZString>(),
+				arenaNodeAllocator(arena, static_cast<const typename ObjectValues::allocator_type*>(0)))
+		{
+		}
+
+		ObjectRep(const ObjectRep& other)
+			: refCount_(1)
+			, inArena_(false)
+			, exposed_(false)
+			, hash_(0)
+			, hashEpoch_(0)
+			, slots_(0)
+			, lookups_(0)
+			, packed_(other.packed_ ? new PackedList(*other.packed_) : 0)
+			, packedState_(other.packed_ ? statePacked : stateGeneral)
+			, source_(0)	// the copy is made to be modified
+			, encodedOffset_(0)
+			, encodedLength_(0)
+		{
+			// other may be unpacking concurrently: its map_ is only read when it has no packed_
+			if (!other.packed_)
+				map_ = other.map_;
+		}
+
+		~ObjectRep()
+		{
+			delete slots_.load(std::memory_order_relaxed);
+			delete packed_;
+			dropEncoding();
+		}
+
+		ArrayIndex size() const
+		{
+			return packed_ ? packed_->size_ : ArrayIndex(map_.size());
+		}
+
+		/// The elements of a packed list as values, built on first use by
+		/// concurrent readers.
+		std::vector<Value>& elements()
+		{
+			if (packedState_.load(std::memory_order_acquire) != stateBoth)
+				buildElements();
+			return packed_->elements_;
+		}
+
+		/// Called on mutation, when no other thread can read the rep.
+		void dropPacked()
+		{
+			if (!packed_)
+				return;
+			packed_->unpackInto(map_);
+			delete packed_;
+			packed_ = 0;
+			packedState_.store(stateGeneral, std::memory_order_relaxed);
+		}
+
+		/// Cached lookups a dict serves by a plain search before it builds its
+		/// slots: a dict read once, or only a few times, gets no table.
+		static const unsigned int lookupsBeforeSlots = 8;
+
+		/// Members in key order, built on first use by concurrent readers.
+		const Slots& slots()
+		{
+			Slots* slots = slots_.load(std::memory_order_acquire);
+			if (slots)
+				return *slots;
+			Slots* built = new Slots;
+			built->reserve(map_.size());
+			for (typename ObjectValues::const_iterator it = map_.begin(); it != map_.end(); ++it)
+				built->push_back(&*it);
+			if (slots_.compare_exchange_strong(slots, built, std::memory_order_acq_rel))
+				return *built;
+			delete built;	// another reader installed its table first
+			return *slots;
+		}
+
+		/// Called on mutation, when no other thread can read the rep.
+		void dropEncoding()
+		{
+			if (!source_)
+				return;
+			source_->release();
+			source_ = 0;
+		}
+
+		/// The cached hash, or 0 if none is cached or it may be stale.
+		std::uint64_t cachedHash() const
+		{
+			std::uint64_t h = hash_.load(std::memory_order_relaxed);
+			if (h == 0)
+				return 0;
+			std::uint64_t epoch = hashEpoch_.load(std::memory_order_relaxed);
+			if (epoch != 0 && epoch != mutationEpoch.load(std::memory_order_acquire))
+				return 0;
+			return h;
+		}
+
+		/// Cache h, valid for ever if epoch is 0, or while the mutation epoch is epoch.
+		void cacheHash(std::uint64_t h, std::uint64_t epoch)
+		{
+			hashEpoch_.store(epoch, std::memory_order_relaxed);
+			hash_.store(h, std::memory_order_relaxed);
+			if (epoch != 0 && !mutationEpochUsed.load(std::memory_order_relaxed))
+				mutationEpochUsed.store(true, std::memory_order_relaxed);
+		}
+
+		/// Called on mutation, when no other thread can read the rep.
+		void resetCaches()
+		{
+			hash_.store(0, std::memory_order_relaxed);
+			delete slots_.exchange(0, std::memory_order_relaxed);
+			lookups_.store(0, std::memory_order_relaxed);
+		}
+
+		ObjectRep* retain()
+		{
+			refCount_.fetch_add(1, std::memory_order_relaxed);
+			return this;
+		}
+
+		/// Drop one reference; true if it was the last one and the caller must destroy the rep.
+		bool release()
+		{
+			return refCount_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+		}
+
+		bool isShared() const
+		{
+			return refCount_.load(std::memory_order_acquire) > 1;
+		}
+
+		static void destroy(ObjectRep* rep)
+		{
+			if (!rep->inArena_)
+			{
+				delete rep;
+				return;
+			}
+			rep->~ObjectRep();
+			ValueArena::releaseOwned(rep);
+		}
+
+		static void* operator new(std::size_t size)
+		{
+			countAllocation(size);
+			return ::operator new(size);
+		}
+
+		static void operator delete(void* p, std::size_t size)
+		{
+			countRelease(size);
+			::operator delete(p);
+		}
+
+		std::atomic<int> refCount_;
+		bool inArena_;	// see Value::compact(); never mutated in place
+		bool exposed_;	// a member was handed out by non-const reference, see noteMutation()
+		std::atomic<std::uint64_t> hash_;	// 0 until computed, reset on mutation
+		std::atomic<std::uint64_t> hashEpoch_;	// mutation epoch hash_ is valid in, or 0 for any
+		std::atomic<Slots*> slots_;	// 0 until a MemberLookup needs it, reset on mutation
+		std::atomic<unsigned int> lookups_;	// cached lookups served without slots_, reset on mutation
+		PackedList* packed_;	// see Value::pack(); immutable while the rep is shared
+		std::atomic<int> packedState_;
+		StringRep* source_;	// document the rep was parsed from, see Value::encoding(); 0 once modified
+		std::size_t encodedOffset_;
+		std::size_t encodedLength_;
+		ObjectValues map_;
+
+	private:
+		void buildElements()
+		{
+			int expected = statePacked;
+			if (packedState_.compare_exchange_strong(expected, stateUnpacking, std::memory_order_acquire))
+			{
+				packed_->buildElements();
+				packedState_.store(stateBoth, std::memory_order_release);
+				return;
+			}
+			while (packedState_.load(std::memory_order_acquire) != stateBoth)
+				std::this_thread::yield();
+		}
+	};
+
+	// class StringPool
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	class BasicStringPool<Traits>::Stripe
+	{
+	public:
+		std::mutex mutex_;
+		typedef std::unordered_map<std::string_view, typename Value::StringRep*> Strings;
+
+		// keys view the data of the mapped rep
+		Strings strings_;
+	};
+
+	static const unsigned int stringPoolStripeCount = 64;
+
+	template<typename Traits>
+	typename BasicStringPool<Traits>::Stripe* BasicStringPool<Traits>::stripes()
+	{
+		// Never destroyed: Values with static storage duration may release
+		// pooled strings after the end of main().
+		static Stripe* stripes = new Stripe[stringPoolStripeCount];
+		return stripes;
+	}
+
+	template<typename Traits>
+	typename BasicStringPool<Traits>::Stripe& BasicStringPool<Traits>::stripeFor(const char* value, unsigned int length)
+	{
+		return stripes()[hashBytes(value, length, hashSeedString) % stringPoolStripeCount];
+	}
+
+	template<typename Traits>
+	BasicValue<Traits> BasicStringPool<Traits>::intern(const char* value, unsigned int length)
+	{
+		std::string_view key(value, length);
+		Stripe& stripe = stripeFor(value, length);
+		std::lock_guard<std::mutex> lock(stripe.mutex_);
+
+		Value result;
+		result.type_ = stringValue;
+		typename Stripe::Strings::iterator it = stripe.strings_.find(key);
+		if (it != stripe.strings_.end())
+		{
+			// A count of 0 means the last reference is being released: the
+			// dying rep can not be revived, it is replaced by a new one.
+			typename Value::StringRep* rep = it->second;
+			int count = rep->refCount_.load(std::memory_order_relaxed);
+			while (count > 0)
+			{
+				if (rep->refCount_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+				{
+					result.value_.string_ = rep;
+					return result;
+				}
+			}
+			stripe.strings_.erase(it);
+		}
+		typename Value::StringRep* rep = Value::StringRep::make(value, length);
+		rep->pooled_ = true;
+		stripe.strings_.emplace(std::string_view(rep->data_, rep->length_), rep);
+		result.value_.string_ = rep;
+		return result;
+	}
+
+	template<typename Traits>
+	BasicValue<Traits> BasicStringPool<Traits>::intern(const std::string& value)
+	{
+		return intern(value.data(), (unsigned int)value.length());
+	}
+
+	template<typename Traits>
+	std::size_t BasicStringPool<Traits>::size()
+	{
+		std::size_t count = 0;
+		Stripe* all = stripes();
+		for (unsigned int i = 0; i < stringPoolStripeCount; ++i)
+		{
+			std::lock_guard<std::mutex> lock(all[i].mutex_);
+			count += all[i].strings_.size();
+		}
+		return count;
+	}
+
+	template<typename Traits>
+	void BasicStringPool<Traits>::forget(typename Value::StringRep* rep)
+	{
+		Stripe& stripe = stripeFor(rep->data_, rep->length_);
+		std::lock_guard<std::mutex> lock(stripe.mutex_);
+		typename Stripe::Strings::iterator it =
+			stripe.strings_.find(std::string_view(rep->data_, rep->length_));
+		// the entry may already belong to a newer copy of the string
+		if (it != stripe.strings_.end() && it->second == rep)
+			stripe.strings_.erase(it);
+	}
+
+	// class MemoryUsage
+	// class Value::MemoryCollector
+	// //////////////////////////////////////////////////////////////////
+
+	MemoryUsage::Entry MemoryUsage::total() const
+	{
+		Entry total;
+		const Entry* entries[] = { &strings_, &keys_, &lists_, &dicts_ };
+		for (std::size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i)
+		{
+			total.allocations_ += entries[i]->allocations_;
+			total.bytes_ += entries[i]->bytes_;
+			total.blockBytes_ += entries[i]->blockBytes_;
+		}
+		return total;
+	}
+
+	template<typename Traits>
+	class BasicValue<Traits>::MemoryCollector
+	{
+	public:
+		/// With exclusive, payloads shared with values outside the subtree
+		/// are left out, with everything below them: only what destroying the
+		/// subtree would free is counted.
+		MemoryCollector(MemoryUsage& usage, bool exclusive)
+			: usage_(usage)
+			, exclusive_(exclusive)
+		{
+		}
+
+		void visitNull(const Value&)
+		{
+		}
+
+		void visitInt(const Value&)
+		{
+		}
+
+		void visitString(const Value& node)
+		{
+			const StringRep* rep = node.value_.string_;
+			if (!rep || !firstVisit(rep, rep->refCount_))
+				return;
+			add(usage_.strings_, sizeof(StringRep));
+			// mapped strings live in the page cache, not on the heap
+			if (rep->storage_ == StringRep::storageHeap || rep->storage_ == StringRep::storageArena)
+				add(usage_.strings_, rep->length_ + 1);
+		}
+
+		bool beginList(const Value& node)
+		{
+			return beginObject(node, usage_.lists_);
+		}
+
+		bool beginDict(const Value& node)
+		{
+			return beginObject(node, usage_.dicts_);
+		}
+
+		void visitKey(std::string_view)
+		{
+		}
+
+		void endList(const Value&)
+		{
+		}
+
+		void endDict(const Value&)
+		{
+		}
+
+	private:
+		// a std::map node holds three links and a color next to the element
+		static const std::size_t nodeSize = sizeof(typename ObjectValues::value_type) + 4 * sizeof(void*);
+
+		// Estimated size of the heap block serving a request of size bytes:
+		// one header word, rounded up to the heap's alignment unit.
+		static std::size_t blockSize(std::size_t size)
+		{
+			const std::size_t unit = 2 * sizeof(void*);
+			std::size_t block = (size + sizeof(void*) + unit - 1) & ~(unit - 1);
+			return block < 2 * unit ? 2 * unit : block;
+		}
+
+		static void add(MemoryUsage::Entry& entry, std::size_t size)
+		{
+			++entry.allocations_;
+			entry.bytes_ += size;
+			entry.blockBytes_ += blockSize(size);
+		}
+
+		template<typename T>
+		static void addBuffer(MemoryUsage::Entry& entry, const std::vector<T>& buffer)
+		{
+			if (buffer.capacity())
+				add(entry, buffer.capacity() * sizeof(T));
+		}
+
+		bool beginObject(const Value& node, MemoryUsage::Entry& entry)
+		{
+			const ObjectRep* rep = node.value_.map_;
+			if (!firstVisit(rep, rep->refCount_))
+				return false;
+			add(entry, sizeof(ObjectRep));
+			// the parsed document, shared by all the containers read from it
+			const StringRep* source = rep->source_;
+			if (source && !exclusive_ && shared_.insert(source).second)
+			{
+				add(usage_.strings_, sizeof(StringRep));
+				add(usage_.strings_, source->length_ + 1);
+			}
+			if (const typename ObjectRep::Slots* slots = rep->slots_.load(std::memory_order_acquire))
+			{
+				add(entry, sizeof(typename ObjectRep::Slots));
+				add(entry, slots->capacity() * sizeof(typename ObjectRep::Slots::value_type));
+			}
+			if (const PackedList* packed = rep->packed_)
+			{
+				add(entry, sizeof(PackedList));
+				addBuffer(entry, packed->ints_);
+				addBuffer(entry, packed->bytes_);
+				addBuffer(entry, packed->offsets_);
+				// the elements are only there once a reader has asked for them
+				if (rep->packedState_.load(std::memory_order_acquire) != ObjectRep::stateBoth)
+					return false;
+				addBuffer(entry, packed->elements_);
+			}
+			for (typename ObjectValues::const_iterator it = rep->map_.begin(); it != rep->map_.end(); ++it)
+			{
+				add(entry, nodeSize);
+				if (it->first.c_str() && !it->first.isStaticString())
+					add(usage_.keys_, it->first.length() + 1);
+			}
+			return true;
+		}
+
+		// payloads shared with other values are only counted once
+		bool firstVisit(const void* rep, int refCount)
+		{
+			if (exclusive_)
+				return refCount <= 1;
+			return refCount <= 1 || shared_.insert(rep).second;
+		}
+
+		MemoryUsage& usage_;
+		bool exclusive_;
+		std::unordered_set<const void*> shared_;
+	};
+
+	// class Value::HashVisitor
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	class BasicValue<Traits>::HashVisitor
+	{
+	public:
+		HashVisitor()
+			: result_(0)
+			, epoch_(mutationEpoch.load(std::memory_order_acquire))
+		{
+		}
+
+		void visitNull(const Value&)
+		{
+			fold(hashAvalanche(hashSeedNull));
+		}
+
+		void visitInt(const Value& node)
+		{
+			fold(hashAvalanche(hashMerge(hashSeedInt, std::uint64_t(node.value_.int_))));
+		}
+
+		void visitString(const Value& node)
+		{
+			std::string_view view = node.asStringView();
+			fold(hashBytes(view.data(), view.length(), hashSeedString));
+		}
+
+		bool beginList(const Value& node)
+		{
+			return beginObject(node, hashSeedList);
+		}
+
+		bool beginDict(const Value& node)
+		{
+			return beginObject(node, hashSeedDict);
+		}
+
+		void visitKey(std::string_view key)
+		{
+			pending_.back() = hashMerge(pending_.back(), hashBytes(key.data(), key.length(), hashSeedString));
+		}
+
+		void endList(const Value& node)
+		{
+			endObject(node);
+		}
+
+		void endDict(const Value& node)
+		{
+			endObject(node);
+		}
+
+		std::uint64_t result_;
+
+	private:
+		bool beginObject(const Value& node, std::uint64_t seed)
+		{
+			ObjectRep* rep = node.value_.map_;
+			std::uint64_t cached = rep->cachedHash();
+			if (cached != 0)
+			{
+				if (rep->hashEpoch_.load(std::memory_order_relaxed) != 0 && !exposed_.empty())
+					exposed_.back() = true;
+				fold(cached);
+				return false;
+			}
+			if (const PackedList* packed = rep->packed_)
+			{
+				// same result as hashing the elements one by one (exposed_ is
+				// false: handing out a member drops the packed form)
+				std::uint64_t h = seed;
+				for (ArrayIndex index = 0; index < packed->size_; ++index)
+				{
+					if (packed->type_ == intValue)
+						h = hashMerge(h, hashAvalanche(hashMerge(hashSeedInt, std::uint64_t(packed->ints_[index]))));
+					else
+					{
+						std::string_view str = packed->string(index);
+						h = hashMerge(h, hashBytes(str.data(), str.length(), hashSeedString));
+					}
+				}
+				fold(finish(rep, h, false));
+				return false;
+			}
+			pending_.push_back(seed);
+			exposed_.push_back(rep->exposed_);
+			return true;
+		}
+
+		void endObject(const Value& node)
+		{
+			// A member handed out by reference can change without the nodes
+			// above it knowing: they cache their hash for the current epoch only.
+			bool exposed = exposed_.back();
+			std::uint64_t h = finish(node.value_.map_, pending_.back(), exposed);
+			pending_.pop_back();
+			exposed_.pop_back();
+			if (exposed && !exposed_.empty())
+				exposed_.back() = true;
+			fold(h);
+		}
+
+		std::uint64_t finish(ObjectRep* rep, std::uint64_t accumulator, bool exposed)
+		{
+			std::uint64_t h = hashAvalanche(accumulator + std::uint64_t(rep->size()));
+			if (h == 0)
+				h = 1;
+			rep->cacheHash(h, exposed ? epoch_ : 0);
+			return h;
+		}
+
+		void fold(std::uint64_t h)
+		{
+			if (pending_.empty())
+				result_ = h;
+			else
+				pending_.back() = hashMerge(pending_.back(), h);
+		}
+
+		// accumulators of the containers being hashed, innermost last
+		std::vector<std::uint64_t> pending_;
+		// whether each of them, or a node below it, is exposed
+		std::vector<bool> exposed_;
+		std::uint64_t epoch_;	// mutation epoch when the walk started
+	};
+
+	// class Value::Compactor
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	class BasicValue<Traits>::Compactor
 	{
-		std::swap(cstr_, other.cstr_);
-		std::swap(index_, other.index_);
-	}
+	public:
+		Compactor()
+			: arena_(new ValueArena)
+		{
+		}
+
+		~Compactor()
+		{
+			arena_->seal();
+		}
+
+		/// Copy the list or dict root into the arena, member by member in
+		/// document order, each followed by its own subtree.
+		void run(const Value& root, Value& result)
+		{
+			relocate(root, result);
+			while (!stack_.empty())
+			{
+				Frame& frame = stack_.back();
+				if (frame.current_ == frame.end_)
+				{
+					stack_.pop_back();
+					continue;
+				}
+				const typename ObjectValues::value_type& member = *frame.current_;
+				++frame.current_;
+				ObjectValues& map = frame.target_->map_;
+				Value& child = relocateKey(map, member.first)->second;
+				relocate(member.second, child);	// may grow stack_: frame is not used past this point
+			}
+		}
+
+	private:
+		class Frame
+		{
+		public:
+			typename ObjectValues::const_iterator current_;
+			typename ObjectValues::const_iterator end_;
+			ObjectRep* target_;
+		};
+
+		typename ObjectValues::iterator relocateKey(ObjectValues& map, const CZString& key)
+		{
+			if (!key.c_str())
+				return map.emplace_hint(map.end(), std::piecewise_construct,
+					std::forward_as_tuple(key.index()), std::forward_as_tuple());
+			if (key.isStaticString())
+				return map.emplace_hint(map.end(), std::piecewise_construct,
+					std::forward_as_tuple(key.c_str(), key.length(), CZString::noDuplication),
+					std::forward_as_tuple());
+			// owned by the arena: copies of the key are duplicated, the key itself is never released
+			char* name = static_cast<char*>(arena_->allocate(key.length() + 1));
+			memcpy(name, key.c_str(), key.length());
+			name[key.length()] = 0;
+			return map.emplace_hint(map.end(), std::piecewise_construct,
+				std::forward_as_tuple(name, key.length(), CZString::duplicateOnCopy),
+				std::forward_as_tuple());
+		}
+
+		void relocate(const Value& source, Value& target)
+		{
+			switch (source.type_)
+			{
+			case nullValue:
+			case intValue:
+				target.value_ = source.value_;
+				break;
+			case stringValue:
+				target.value_.string_ = source.value_.string_ ? relocate(source.value_.string_) : 0;
+				break;
+			case listValue:
+			case dictValue:
+				target.value_.map_ = relocate(source.value_.map_);
+				break;
+			}
+			target.type_ = source.type_;
+		}
+
+		StringRep* relocate(StringRep* source)
+		{
+			if (source->storage_ == StringRep::storageStatic || source->storage_ == StringRep::storageMapped
+				|| source->pooled_)
+				return source->retain();
+			if (source->refCount_.load(std::memory_order_relaxed) == 1)
+				return StringRep::makeInArena(*arena_, source->data_, source->length_);
+			void*& copy = relocated_[source];
+			if (copy)
+				return static_cast<StringRep*>(copy)->retain();
+			StringRep* rep = StringRep::makeInArena(*arena_, source->data_, source->length_);
+			copy = rep;
+			return rep;
+		}
+
+		ObjectRep* relocate(ObjectRep* source)
+		{
+			if (source->packed_)
+				return source->retain();	// already contiguous
+			void** copy = 0;
+			if (source->isShared())
+			{
+				copy = &relocated_[source];
+				if (*copy)
+					return static_cast<ObjectRep*>(*copy)->retain();
+			}
+			stack_.reserve(stack_.size() + 1);	// nothing below may throw once the rep exists
+			ObjectRep* rep = ::new (arena_->allocateOwned(sizeof(ObjectRep))) ObjectRep(arena_);
+			if (copy)
+				*copy = rep;
+			Frame frame;
+			frame.current_ = source->map_.begin();
+			frame.end_ = source->map_.end();
+			frame.target_ = rep;
+			stack_.push_back(frame);
+			return rep;
+		}
+
+		ValueArena* arena_;
+		std::vector<Frame> stack_;
+		// payloads referenced more than once, so that they stay shared in the copy
+		std::unordered_map<const void*, void*> relocated_;
+	};
+
+	// class Value
+	// //////////////////////////////////////////////////////////////////
 
-	Value::Value(ValueType type)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(ValueType type)
 		: type_(type)
-		, stringlength_(0)
-		, allocated_(0)
 	{
 		switch (type)
 		{
@@ -156,47 +1510,53 @@ namespace Bencode {
 			break;
 		case listValue:
 		case dictValue:
-			value_.map_ = new ObjectValues();
+			value_.map_ = new ObjectRep();
 			break;
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
 	}
-	Value::Value(Int value)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(Int value)
 		: type_(intValue)
 	{
 		value_.int_ = value;
 	}
-	Value::Value(const char* value, UInt length)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(const char* value, UInt length)
 		: type_(stringValue)
-		, allocated_(true)
 	{
-		value_.string_ = valueAllocator()->duplicateStringValue(value, length);
-		stringlength_ = length;
+		value_.string_ = StringRep::make(value, length);
+	}
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::mappedString(const char* value, UInt length)
+	{
+		Value result;
+		result.type_ = stringValue;
+		result.value_.string_ = StringRep::makeMapped(value, length);
+		return result;
 	}
-	Value::Value(const char* beginValue, const char* endValue)
+
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(const char* beginValue, const char* endValue)
 		: type_(stringValue)
-		, allocated_(true)
 	{
-		value_.string_ = valueAllocator()->duplicateStringValue(beginValue,
-			UInt(endValue - beginValue));
-		stringlength_ = endValue - beginValue;
+		value_.string_ = StringRep::make(beginValue, UInt(endValue - beginValue));
 	}
-	Value::Value(const StaticString& value)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(const StaticString& value)
 		: type_(stringValue)
-		, allocated_(false)
 	{
-		value_.string_ = const_cast<char*>(value.c_str());
+		value_.string_ = StringRep::makeStatic(value.c_str());
 	}
-	Value::Value(const std::string& value)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(const std::string& value)
 		: type_(stringValue)
-		, allocated_(true)
 	{
-		value_.string_ = valueAllocator()->duplicateStringValue(value.c_str(),
-			(unsigned int)value.length());
-		stringlength_ = (unsigned int)value.length();
+		value_.string_ = StringRep::make(value.c_str(), (unsigned int)value.length());
 	}
-	Value::Value(const Value& other)
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(const Value& other)
 		: type_(other.type_)
 	{
 		switch (type_)
@@ -206,26 +1566,30 @@ namespace Bencode {
 			value_ = other.value_;
 			break;
 		case stringValue:
-			if (other.value_.string_)
-			{
-				value_.string_ = valueAllocator()->duplicateStringValue(other.value_.string_, other.stringlength_);
-				stringlength_ = other.stringlength_;
-				allocated_ = true;
-			}
-			else {
-				value_.string_ = 0;
-				stringlength_ = 0;
-			}
+			value_.string_ = other.value_.string_ ? other.value_.string_->retain() : 0;
 			break;
 		case listValue:
 		case dictValue:
-			value_.map_ = new ObjectValues(*other.value_.map_);
+			value_.map_ = other.value_.map_->retain();
 			break;
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
 	}
-	Value::~Value()
+	template<typename Traits>
+	BasicValue<Traits>::BasicValue(Value&& other)
+		: type_(other.type_)
+	{
+		value_ = other.value_;
+		other.type_ = nullValue;
+	}
+	template<typename Traits>
+	BasicValue<Traits>::~BasicValue()
+	{
+		releasePayload();
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::releasePayload()
 	{
 		switch (type_)
 		{
@@ -233,125 +1597,338 @@ namespace Bencode {
 		case intValue:
 			break;
 		case stringValue:
-			if (allocated_)
-				valueAllocator()->releaseStringValue(value_.string_);
+			if (value_.string_)
+				value_.string_->release();
 			break;
 		case listValue:
 		case dictValue:
-			delete value_.map_;
+			if (value_.map_->release())
+				destroyObject(value_.map_);
 			break;
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
 	}
-	Value& Value::operator=(const Value& other)
+	template<typename Traits>
+	void BasicValue<Traits>::destroyObject(ObjectRep* rep)
+	{
+		// Unlinks nested containers before deleting each rep, so that the map
+		// destructors never recurse: the teardown runs in constant stack depth.
+		std::vector<ObjectRep*> pending;
+		for (;;)
+		{
+			for (typename ObjectValues::iterator it = rep->map_.begin(); it != rep->map_.end(); ++it)
+			{
+				Value& child = it->second;
+				if (child.type_ == listValue || child.type_ == dictValue)
+				{
+					child.type_ = nullValue;
+					if (child.value_.map_->release())
+						pending.push_back(child.value_.map_);
+				}
+			}
+			ObjectRep::destroy(rep);
+			if (pending.empty())
+				return;
+			rep = pending.back();
+			pending.pop_back();
+		}
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::detachObject()
+	{
+		noteMutation();
+		if (value_.map_->isShared() || value_.map_->inArena_)
+		{
+			ObjectRep* rep = new ObjectRep(*value_.map_);
+			if (value_.map_->release())
+				destroyObject(value_.map_);
+			value_.map_ = rep;
+		}
+		else
+		{
+			value_.map_->resetCaches();
+			value_.map_->dropEncoding();
+		}
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::exposeObject()
+	{
+		detachObject();
+		value_.map_->dropPacked();
+		value_.map_->exposed_ = true;
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::sealObject()
+	{
+		if (type_ == listValue || type_ == dictValue)
+			value_.map_->exposed_ = false;
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::setEncoding(const Value& source, std::size_t offset, std::size_t length)
+	{
+		BENCODE_ASSERT((type_ == listValue || type_ == dictValue) && source.type_ == stringValue);
+		ObjectRep* rep = value_.map_;
+		rep->dropEncoding();
+		rep->source_ = source.value_.string_->retain();
+		rep->encodedOffset_ = offset;
+		rep->encodedLength_ = length;
+	}
+	template<typename Traits>
+	bool BasicValue<Traits>::isConsumable() const
+	{
+		return (type_ == listValue || type_ == dictValue)
+			&& !value_.map_->isShared() && !value_.map_->inArena_ && !value_.map_->packed_;
+	}
+	template<typename Traits>
+	bool BasicValue<Traits>::popFront(Value& member, std::string& key)
+	{
+		BENCODE_ASSERT(isConsumable());
+		ObjectValues& map = value_.map_->map_;
+		if (map.empty())
+			return false;
+		noteMutation();
+		value_.map_->resetCaches();
+		typename ObjectValues::iterator it = map.begin();
+		if (type_ == dictValue)
+			key.assign(it->first.c_str(), it->first.length());
+		member = std::move(it->second);
+		map.erase(it);
+		return true;
+	}
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator=(const Value& other)
 	{
 		// TODO: ڴ˴ return 
 		Value temp(other);
 		swap(temp);
 		return *this;
 	}
-	void Value::swap(Value& other)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator=(Value&& other)
+	{
+		Value temp(std::move(other));
+		swap(temp);
+		return *this;
+	}
+	template<typename Traits>
+	void BasicValue<Traits>::swap(Value& other)
 	{
+		noteMutation();
 		ValueType temp = type_;
 		type_ = other.type_;
-		UInt templength = stringlength_;
-		stringlength_ = other.stringlength_;
-		other.stringlength_ = templength;
 		other.type_ = temp;
 		std::swap(value_, other.value_);
-		int temp2 = allocated_;
-		allocated_ = other.allocated_;
-		other.allocated_ = temp2;
 	}
-	ValueType Value::type() const
+	template<typename Traits>
+	ValueType BasicValue<Traits>::type() const
 	{
 		return type_;
 	}
-	bool Value::operator<(const Value& other) const
+	template<typename Traits>
+	int BasicValue<Traits>::compareNode(const Value& a, const Value& b, bool equalityOnly, bool& descend)
 	{
-		int typeDelta = type_ - other.type_;
+		descend = false;
+		int typeDelta = a.type_ - b.type_;
 		if (typeDelta)
-			return typeDelta < 0 ? true : false;
-		switch (type_)
+			return typeDelta;
+		switch (a.type_)
 		{
 		case nullValue:
-			return false;
+			return 0;
 		case intValue:
-			return value_.int_ < other.value_.int_;
+			return a.value_.int_ < b.value_.int_ ? -1 : (b.value_.int_ < a.value_.int_ ? 1 : 0);
 		case stringValue:
-			return (value_.string_ == 0 && other.value_.string_)
-				|| (other.value_.string_
-					&& value_.string_
-					&& strcmp(value_.string_, other.value_.string_) < 0);
+			if (a.value_.string_ == b.value_.string_)
+				return 0;
+			return a.asStringView().compare(b.asStringView());
 		case listValue:
 		case dictValue:
 		{
-			int delta = int(value_.map_->size() - other.value_.map_->size());
+			if (a.value_.map_ == b.value_.map_)
+				return 0;
+			int delta = int(a.value_.map_->size() - b.value_.map_->size());
 			if (delta)
-				return delta < 0;
-			return (*value_.map_) < (*other.value_.map_);
+				return delta;
+			if (a.value_.map_->packed_ || b.value_.map_->packed_)
+				return comparePacked(a, b);
+			// different cached hashes settle it; hashing here instead would
+			// walk the subtrees once per level
+			if (equalityOnly)
+			{
+				std::uint64_t hashA = a.value_.map_->cachedHash();
+				std::uint64_t hashB = hashA ? b.value_.map_->cachedHash() : 0;
+				if (hashB && hashA != hashB)
+					return 1;
+			}
+			descend = a.value_.map_->size() != 0;
+			return 0;
 		}
-
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
-		return 0;  // unreachable
+		return 0; // unreachable
+	}
+	// Lists of equal size, at least one of them packed, element by element
+	// from the packed arrays.
+	template<typename Traits>
+	int BasicValue<Traits>::comparePacked(const Value& a, const Value& b)
+	{
+		const PackedList* packedA = a.value_.map_->packed_;
+		const PackedList* packedB = b.value_.map_->packed_;
+		if (!packedA)
+		{
+			int result = comparePacked(b, a);
+			return result < 0 ? 1 : (result > 0 ? -1 : 0);
+		}
+		typename ObjectValues::const_iterator it = b.value_.map_->map_.begin();
+		for (ArrayIndex index = 0; index < packedA->size_; ++index)
+		{
+			ValueType typeB = packedB ? packedB->type_ : it->second.type_;
+			if (!packedB && ArrayIndex(it->first.index()) != index)
+				return -1;	// missing from b, which has a member at a larger index
+			int typeDelta = packedA->type_ - typeB;
+			if (typeDelta)
+				return typeDelta;
+			int result;
+			if (typeB == intValue)
+			{
+				Int intA = packedA->ints_[index];
+				Int intB = packedB ? packedB->ints_[index] : it->second.value_.int_;
+				result = intA < intB ? -1 : (intB < intA ? 1 : 0);
+			}
+			else
+			{
+				std::string_view stringB = packedB ? packedB->string(index) : it->second.asStringView();
+				result = packedA->string(index).compare(stringB);
+			}
+			if (result != 0)
+				return result;
+			if (!packedB)
+				++it;
+		}
+		return 0;
+	}
+	template<typename Traits>
+	int BasicValue<Traits>::compare(const Value& a, const Value& b, bool equalityOnly)
+	{
+		bool descend;
+		int result = compareNode(a, b, equalityOnly, descend);
+		if (result != 0 || !descend)
+			return result;
+
+		// Containers of equal size are compared member by member (key, then
+		// value), depth first, with the pending levels on an explicit stack.
+		struct Frame
+		{
+			const_iterator a_;
+			const_iterator aEnd_;
+			const_iterator b_;
+		};
+		std::vector<Frame> stack;
+		Frame root = { a.begin(), a.end(), b.begin() };
+		stack.push_back(root);
+		while (!stack.empty())
+		{
+			Frame& frame = stack.back();
+			if (frame.a_ == frame.aEnd_)
+			{
+				stack.pop_back();
+				continue;
+			}
+			int keyOrder = frame.a_.compareKey(frame.b_);
+			if (keyOrder != 0)
+				return keyOrder;
+			const Value& childA = *frame.a_;
+			const Value& childB = *frame.b_;
+			++frame.a_;
+			++frame.b_;
+			result = compareNode(childA, childB, equalityOnly, descend);
+			if (result != 0)
+				return result;
+			if (descend)
+			{
+				Frame child = { childA.begin(), childA.end(), childB.begin() };
+				stack.push_back(child);
+			}
+		}
+		return 0;
+	}
+	template<typename Traits>
+	bool BasicValue<Traits>::operator<(const Value& other) const
+	{
+		return compare(*this, other, false) < 0;
 	}
-	bool Value::operator<=(const Value& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::operator<=(const Value& other) const
 	{
-		return !(other > * this);
+		return !(other < *this);
 	}
-	bool Value::operator>=(const Value& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::operator>=(const Value& other) const
 	{
 		return !(*this < other);
 	}
-	bool Value::operator>(const Value& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::operator>(const Value& other) const
 	{
 		return other < *this;
 	}
-	bool Value::operator==(const Value& other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::operator==(const Value& other) const
+	{
+		return compare(*this, other, true) == 0;
+	}
+	template<typename Traits>
+	bool BasicValue<Traits>::operator!=(const Value& other) const
+	{
+		return !(*this == other);
+	}
+	template<typename Traits>
+	std::size_t BasicValue<Traits>::hash() const
 	{
-		int temp = other.type_;
-		if (type_ != temp)
-			return false;
 		switch (type_)
 		{
 		case nullValue:
-			return true;
+			return std::size_t(hashAvalanche(hashSeedNull));
 		case intValue:
-			return value_.int_ == other.value_.int_;
+			return std::size_t(hashAvalanche(hashMerge(hashSeedInt, std::uint64_t(value_.int_))));
 		case stringValue:
-			return (value_.string_ == other.value_.string_)
-				|| (other.value_.string_
-					&& value_.string_
-					&& strcmp(value_.string_, other.value_.string_) == 0);
+		{
+			std::string_view view = asStringView();
+			return std::size_t(hashBytes(view.data(), view.length(), hashSeedString));
+		}
 		case listValue:
 		case dictValue:
-			return value_.map_->size() == other.value_.map_->size()
-				&& (*value_.map_) == (*other.value_.map_);
+		{
+			std::uint64_t h = value_.map_->cachedHash();
+			if (h != 0)
+				return std::size_t(h);
+			HashVisitor visitor;
+			BasicTraversal<Traits> traversal;
+			traversal.traverse(*this, visitor);
+			return std::size_t(visitor.result_);
+		}
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
-		return 0;  // unreachable
-	}
-	bool Value::operator!=(const Value& other) const
-	{
-		return !(*this == other);
+		return 0; // unreachable
 	}
-	const char* Value::asCString() const
+	template<typename Traits>
+	const char* BasicValue<Traits>::asCString() const
 	{
 		BENCODE_ASSERT(type_ == stringValue);
-		return value_.string_;
+		return value_.string_ ? value_.string_->data_ : 0;
 	}
-	std::string Value::asString() const
+	template<typename Traits>
+	std::string BasicValue<Traits>::asString() const
 	{
 		switch (type_)
 		{
 		case nullValue:
 			return "";
 		case stringValue:
-			return value_.string_ ? value_.string_ : "";
+			return value_.string_ ? std::string(value_.string_->data_, value_.string_->length_) : "";
 		case listValue:
 		case dictValue:
 			BENCODE_ASSERT_MESSAGE(false, "Type is not convertible to string");
@@ -360,7 +1937,35 @@ namespace Bencode {
 		}
 		return ""; // unreachable
 	}
-	Value::Int Value::asInt() const
+	template<typename Traits>
+	std::string_view BasicValue<Traits>::encoding() const
+	{
+		if ((type_ != listValue && type_ != dictValue) || !value_.map_->source_)
+			return std::string_view();
+		return std::string_view(value_.map_->source_->data_ + value_.map_->encodedOffset_,
+			value_.map_->encodedLength_);
+	}
+	template<typename Traits>
+	std::string_view BasicValue<Traits>::asStringView() const
+	{
+		switch (type_)
+		{
+		case nullValue:
+			return std::string_view();
+		case stringValue:
+			return value_.string_ ? std::string_view(value_.string_->data_, value_.string_->length_)
+				: std::string_view();
+		case intValue:
+		case listValue:
+		case dictValue:
+			BENCODE_ASSERT_MESSAGE(false, "Type is not convertible to string");
+		default:
+			BENCODE_ASSERT_UNREACHABLE;
+		}
+		return std::string_view(); // unreachable
+	}
+	template<typename Traits>
+	typename BasicValue<Traits>::Int BasicValue<Traits>::asInt() const
 	{
 		switch (type_)
 		{
@@ -377,23 +1982,28 @@ namespace Bencode {
 		}
 		return 0; // unreachable;
 	}
-	bool Value::isInt() const
+	template<typename Traits>
+	bool BasicValue<Traits>::isInt() const
 	{
 		return type_ == intValue;
 	}
-	bool Value::isString() const
+	template<typename Traits>
+	bool BasicValue<Traits>::isString() const
 	{
 		return type_ == stringValue;
 	}
-	bool Value::isList() const
+	template<typename Traits>
+	bool BasicValue<Traits>::isList() const
 	{
 		return type_ == nullValue || type_ == listValue;
 	}
-	bool Value::isDict() const
+	template<typename Traits>
+	bool BasicValue<Traits>::isDict() const
 	{
 		return type_ == nullValue || type_ == dictValue;
 	}
-	bool Value::isConvertibleTo(ValueType other) const
+	template<typename Traits>
+	bool BasicValue<Traits>::isConvertibleTo(ValueType other) const
 	{
 		switch (type_)
 		{
@@ -405,7 +2015,7 @@ namespace Bencode {
 				|| other == stringValue;
 		case stringValue:
 			return other == stringValue
-				|| (other == nullValue && (!value_.string_ || value_.string_[0] == 0));
+				|| (other == nullValue && (!value_.string_ || value_.string_->length_ == 0));
 		case listValue:
 			return other == listValue
 				|| (other == nullValue && value_.map_->size() == 0);
@@ -417,7 +2027,8 @@ namespace Bencode {
 		}
 		return false; // unreachable;
 	}
-	Value::UInt Value::size() const
+	template<typename Traits>
+	typename BasicValue<Traits>::UInt BasicValue<Traits>::size() const
 	{
 		switch (type_)
 		{
@@ -426,22 +2037,25 @@ namespace Bencode {
 		case stringValue:
 			return 0;
 		case listValue:  // size of the array is highest index + 1
-			if (!value_.map_->empty())
+			if (value_.map_->packed_)
+				return value_.map_->packed_->size_;
+			if (!value_.map_->map_.empty())
 			{
-				ObjectValues::const_iterator itLast = value_.map_->end();
+				typename ObjectValues::const_iterator itLast = value_.map_->map_.end();
 				--itLast;
 				return (*itLast).first.index() + 1;
 			}
 			return 0;
 		case dictValue:
-			return Int(value_.map_->size());
+			return Int(value_.map_->map_.size());
 		default:
 			BENCODE_ASSERT_UNREACHABLE;
 		}
 		return 0; // unreachable;
 	}
 
-	bool Value::empty() const
+	template<typename Traits>
+	bool BasicValue<Traits>::empty() const
 	{
 		if (isList() || isDict())
 			return size() == 0u;
@@ -449,7 +2063,8 @@ namespace Bencode {
 			return false;
 	}
 
-	void Value::clear()
+	template<typename Traits>
+	void BasicValue<Traits>::clear()
 	{
 		BENCODE_ASSERT(type_ == nullValue || type_ == listValue || type_ == dictValue);
 
@@ -457,174 +2072,418 @@ namespace Bencode {
 		{
 		case listValue:
 		case dictValue:
-			value_.map_->clear();
+			detachObject();
+			value_.map_->dropPacked();
+			value_.map_->map_.clear();
 			break;
 		default:
 			break;
 		}
 	}
 
-	Value& Value::operator[](UInt index)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator[](ArrayIndex index)
 	{
 		// TODO: ڴ˴ return 
 		BENCODE_ASSERT(type_ == nullValue || type_ == listValue);
 		if (type_ == nullValue)
 			*this = Value(listValue);
+		exposeObject();
+		ObjectValues& map = value_.map_->map_;
 		CZString key(index);
-		ObjectValues::iterator it = value_.map_->lower_bound(key);
-		if (it != value_.map_->end() && (*it).first == key)
+		typename ObjectValues::iterator it = map.lower_bound(key);
+		if (it != map.end() && (*it).first == key)
 			return (*it).second;
 
-		ObjectValues::value_type defaultValue(key, null);
-		it = value_.map_->insert(it, defaultValue);
+		typename ObjectValues::value_type defaultValue(key, null);
+		it = map.insert(it, defaultValue);
 		return (*it).second;
 	}
 
-	const Value& Value::operator[](UInt index) const
+	template<typename Traits>
+	const BasicValue<Traits>& BasicValue<Traits>::operator[](ArrayIndex index) const
 	{
 		// TODO: ڴ˴ return 
 		BENCODE_ASSERT(type_ == nullValue || type_ == listValue);
 		if (type_ == nullValue)
 			return null;
+		if (value_.map_->packed_)
+		{
+			if (index >= value_.map_->packed_->size_)
+				return null;
+			return value_.map_->elements()[index];
+		}
 		CZString key(index);
-		ObjectValues::const_iterator it = value_.map_->find(key);
-		if (it == value_.map_->end())
+		const ObjectValues& map = value_.map_->map_;
+		typename ObjectValues::const_iterator it = map.find(key);
+		if (it == map.end())
 			return null;
 		return (*it).second;
 	}
 
-	Value Value::get(UInt index, const Value& defaultValue) const
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::get(ArrayIndex index, const Value& defaultValue) const
 	{
+		if (type_ == listValue && value_.map_->packed_)
+		{
+			// by value: no need for the element nodes
+			const PackedList* packed = value_.map_->packed_;
+			return index < packed->size_ ? packed->element(index) : defaultValue;
+		}
 		const Value* value = &((*this)[index]);
 		return value == &null ? defaultValue : *value;
 	}
 
-	bool Value::isValidIndex(UInt index) const
+	template<typename Traits>
+	bool BasicValue<Traits>::isValidIndex(ArrayIndex index) const
 	{
 		return index < size();
 	}
 
-	Value& Value::append(const Value& value)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::append(const Value& value)
 	{
 		// TODO: ڴ˴ return 
 		return (*this)[size()] = value;
 	}
 
-	Value& Value::operator[](const char* key)
+	template<typename Traits>
+	bool BasicValue<Traits>::insert(ArrayIndex index, const Value& value)
+	{
+		BENCODE_ASSERT(type_ == nullValue || type_ == listValue);
+		if (type_ == nullValue)
+			*this = Value(listValue);
+		ArrayIndex length = size();
+		if (index > length)
+			return false;
+		detachObject();
+		ObjectRep* rep = value_.map_;
+		if (rep->packed_ && rep->packed_->insert(index, value))
+		{
+			rep->packedState_.store(ObjectRep::statePacked, std::memory_order_relaxed);
+			return true;
+		}
+		rep->dropPacked();
+		ObjectValues& map = rep->map_;
+		// move the elements from index on one place up, the last one first
+		for (ArrayIndex moved = length; moved > index; --moved)
+			map[CZString(moved)] = std::move(map[CZString(moved - 1)]);
+		map[CZString(index)] = value;
+		return true;
+	}
+
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator[](const char* key)
 	{
 		// TODO: ڴ˴ return 
-		return resolveReference(key, false);
+		return resolveReference(key, UInt(strlen(key)), false);
 	}
 
-	const Value& Value::operator[](const char* key) const
+	template<typename Traits>
+	const BasicValue<Traits>& BasicValue<Traits>::operator[](const char* key) const
 	{
 		// TODO: ڴ˴ return 
 		BENCODE_ASSERT(type_ == nullValue || type_ == dictValue);
-		if (type_ == nullValue)
-			return null;
-		CZString actualKey(key, CZString::noDuplication);
-		ObjectValues::const_iterator it = value_.map_->find(actualKey);
-		if (it == value_.map_->end())
-			return null;
-		return (*it).second;
+		const Value* value = find(key);
+		return value ? *value : null;
 	}
 
-	Value& Value::operator[](const std::string& key)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator[](const std::string& key)
 	{
 		// TODO: ڴ˴ return 
-		return (*this)[key.c_str()];
+		return resolveReference(key.data(), UInt(key.length()), false);
 	}
 
-	const Value& Value::operator[](const std::string& key) const
+	template<typename Traits>
+	const BasicValue<Traits>& BasicValue<Traits>::operator[](const std::string& key) const
 	{
 		// TODO: ڴ˴ return 
-		return (*this)[key.c_str()];
+		BENCODE_ASSERT(type_ == nullValue || type_ == dictValue);
+		const Value* value = find(key);
+		return value ? *value : null;
 	}
 
-	Value& Value::operator[](const StaticString& key)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::operator[](const StaticString& key)
 	{
 		// TODO: ڴ˴ return 
-		return resolveReference(key, true);
+		return resolveReference(key, UInt(strlen(key)), true);
+	}
+
+	template<typename Traits>
+	const BasicValue<Traits>* BasicValue<Traits>::find(std::string_view key) const
+	{
+		if (type_ != dictValue)
+			return 0;
+		CZString actualKey(key.data(), UInt(key.length()), CZString::noDuplication);
+		typename ObjectValues::const_iterator it = value_.map_->map_.find(actualKey);
+		if (it == value_.map_->map_.end())
+			return 0;
+		return &(*it).second;
+	}
+
+	template<typename Traits>
+	const BasicValue<Traits>* BasicValue<Traits>::find(const MemberLookup& lookup) const
+	{
+		if (type_ != dictValue)
+			return 0;
+		ObjectRep* rep = value_.map_;
+		const std::string& key = lookup.key_;
+		if (!rep->slots_.load(std::memory_order_acquire))
+		{
+			// Not worth a table yet. Racing readers may lose counts: it only
+			// delays the table.
+			unsigned int lookups = rep->lookups_.load(std::memory_order_relaxed);
+			if (lookups < ObjectRep::lookupsBeforeSlots)
+			{
+				rep->lookups_.store(lookups + 1, std::memory_order_relaxed);
+				return find(std::string_view(key));
+			}
+		}
+		const typename ObjectRep::Slots& slots = rep->slots();
+		ArrayIndex position = lookup.position_.load(std::memory_order_relaxed);
+		if (position < slots.size())
+		{
+			const CZString& name = slots[position]->first;
+			if (name.length() == key.length() && memcmp(name.c_str(), key.data(), key.length()) == 0)
+				return &slots[position]->second;
+		}
+
+		// the slots are in key order: binary search, then remember the position
+		CZString actualKey(key.data(), UInt(key.length()), CZString::noDuplication);
+		typename ObjectRep::Slots::const_iterator it = std::lower_bound(slots.begin(), slots.end(), actualKey,
+			[](const typename ObjectValues::value_type* member, const CZString& name) { return member->first < name; });
+		if (it == slots.end() || actualKey < (*it)->first)
+			return 0;
+		lookup.position_.store(ArrayIndex(it - slots.begin()), std::memory_order_relaxed);
+		return &(*it)->second;
+	}
+
+	template<typename Traits>
+	bool BasicValue<Traits>::pack()
+	{
+		if (type_ != listValue)
+			return false;
+		if (value_.map_->packed_)
+			return true;
+		const ObjectValues* map = &value_.map_->map_;
+		if (map->empty() || map->size() != size())
+			return false;	// empty or sparse
+		ValueType elementType = map->begin()->second.type_;
+		if (elementType != intValue && elementType != stringValue)
+			return false;
+		std::size_t totalLength = 0;
+		UInt stride = elementType == stringValue ? map->begin()->second.getStringLength() : 0;
+		bool uniform = true;
+		for (typename ObjectValues::const_iterator it = map->begin(); it != map->end(); ++it)
+		{
+			if (it->second.type_ != elementType)
+				return false;
+			if (elementType == stringValue)
+			{
+				UInt length = it->second.getStringLength();
+				totalLength += length;
+				uniform = uniform && length == stride;
+			}
+		}
+
+		detachObject();
+		map = &value_.map_->map_;
+		PackedList* packed = new PackedList;
+		packed->type_ = elementType;
+		packed->size_ = ArrayIndex(map->size());
+		packed->stride_ = uniform ? stride : 0;
+		if (elementType == intValue)
+			packed->ints_.reserve(map->size());
+		else
+			packed->bytes_.reserve(totalLength);
+		if (!uniform)
+			packed->offsets_.reserve(map->size() + 1);
+		for (typename ObjectValues::const_iterator it = map->begin(); it != map->end(); ++it)
+		{
+			if (elementType == intValue)
+			{
+				packed->ints_.push_back(it->second.value_.int_);
+				continue;
+			}
+			if (!uniform)
+				packed->offsets_.push_back(packed->bytes_.size());
+			std::string_view str = it->second.asStringView();
+			packed->bytes_.insert(packed->bytes_.end(), str.begin(), str.end());
+		}
+		if (!uniform)
+			packed->offsets_.push_back(packed->bytes_.size());
+
+		value_.map_->map_.clear();
+		value_.map_->packed_ = packed;
+		value_.map_->packedState_.store(ObjectRep::statePacked, std::memory_order_relaxed);
+		return true;
+	}
+
+	template<typename Traits>
+	bool BasicValue<Traits>::isPacked() const
+	{
+		return type_ == listValue && value_.map_->packed_ != 0;
+	}
+
+	template<typename Traits>
+	const typename BasicValue<Traits>::Int* BasicValue<Traits>::packedInts() const
+	{
+		if (!isPacked() || value_.map_->packed_->type_ != intValue)
+			return 0;
+		return value_.map_->packed_->ints_.data();
+	}
+
+	template<typename Traits>
+	const char* BasicValue<Traits>::packedStrings(UInt& stride) const
+	{
+		if (!isPacked() || value_.map_->packed_->type_ != stringValue
+			|| !value_.map_->packed_->offsets_.empty())
+			return 0;
+		stride = value_.map_->packed_->stride_;
+		return value_.map_->packed_->bytes_.data();
+	}
+
+	template<typename Traits>
+	std::string_view BasicValue<Traits>::packedString(ArrayIndex index) const
+	{
+		if (!isPacked() || value_.map_->packed_->type_ != stringValue || index >= value_.map_->packed_->size_)
+			return std::string_view();
+		return value_.map_->packed_->string(index);
+	}
+
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::get(const char* key, const Value& defaultValue) const
+	{
+		const Value* value = &((*this)[key]);
+		return value == &null ? defaultValue : *value;
 	}
 
-	Value Value::get(const char* key, const Value& defaultValue) const
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::get(const std::string& key, const Value& defaultValue) const
 	{
 		const Value* value = &((*this)[key]);
 		return value == &null ? defaultValue : *value;
 	}
 
-	Value Value::get(const std::string& key, const Value& defaultValue) const
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::removeMember(const char* key)
 	{
-		return get(key.c_str(), defaultValue);
+		return removeMember(CZString(key, CZString::noDuplication));
 	}
 
-	Value Value::removeMember(const char* key)
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::removeMember(const std::string& key)
+	{
+		return removeMember(CZString(key.data(), UInt(key.length()), CZString::noDuplication));
+	}
+
+	template<typename Traits>
+	BasicValue<Traits> BasicValue<Traits>::removeMember(const CZString& key)
 	{
 		BENCODE_ASSERT(type_ == nullValue || type_ == dictValue);
 		if (type_ == nullValue)
 			return null;
-		CZString actualKey(key, CZString::noDuplication);
-		ObjectValues::iterator it = value_.map_->find(actualKey);
-		if (it == value_.map_->end())
+		detachObject();
+		ObjectValues& map = value_.map_->map_;
+		typename ObjectValues::iterator it = map.find(key);
+		if (it == map.end())
 			return null;
-		Value old(it->second);
-		value_.map_->erase(it);
+		Value old(std::move(it->second));
+		map.erase(it);
 		return old;
 	}
 
-	Value Value::removeMember(const std::string& key)
-	{
-		return removeMember(key.c_str());
-	}
-
-	bool Value::isMember(const char* key) const
+	template<typename Traits>
+	bool BasicValue<Traits>::isMember(const char* key) const
 	{
 		const Value* value = &((*this)[key]);
 		return value != &null;
 	}
 
-	bool Value::isMember(const std::string& key) const
+	template<typename Traits>
+	bool BasicValue<Traits>::isMember(const std::string& key) const
 	{
-		return isMember(key.c_str());
+		const Value* value = &((*this)[key]);
+		return value != &null;
 	}
 
-	Value::Members Value::getMemberNames() const
+	template<typename Traits>
+	typename BasicValue<Traits>::Members BasicValue<Traits>::getMemberNames() const
 	{
 		BENCODE_ASSERT(type_ == nullValue || type_ == dictValue);
 		if (type_ == nullValue)
 			return Value::Members();
 		Members members;
-		members.reserve(value_.map_->size());
-		ObjectValues::const_iterator it = value_.map_->begin();
-		ObjectValues::const_iterator itEnd = value_.map_->end();
+		members.reserve(value_.map_->map_.size());
+		typename ObjectValues::const_iterator it = value_.map_->map_.begin();
+		typename ObjectValues::const_iterator itEnd = value_.map_->map_.end();
 		for (; it != itEnd; ++it)
-			members.push_back(std::string((*it).first.c_str()));
+			members.push_back(std::string((*it).first.c_str(), (*it).first.length()));
 		return members;
 	}
 
+	template<typename Traits>
+	MemoryUsage BasicValue<Traits>::memoryUsage() const
+	{
+		MemoryUsage usage;
+		MemoryCollector collector(usage, false);
+		BasicTraversal<Traits> traversal;
+		traversal.traverse(*this, collector);
+		return usage;
+	}
+
+	template<typename Traits>
+	MemoryUsage BasicValue<Traits>::exclusiveMemoryUsage() const
+	{
+		MemoryUsage usage;
+		MemoryCollector collector(usage, true);
+		BasicTraversal<Traits> traversal;
+		traversal.traverse(*this, collector);
+		return usage;
+	}
+
+	template<typename Traits>
+	void BasicValue<Traits>::compact()
+	{
+		if (type_ != listValue && type_ != dictValue)
+			return;
+		Value compacted;
+		{
+			Compactor compactor;
+			compactor.run(*this, compacted);
+		}
+		swap(compacted);
+	}
+
 	//std::string Value::toStyledString() const
 	//{
 	//	StyledWriter writer;
 	//	return writer.write(*this);
 	//}
 
-	UInt Value::getStringLength() const
+	template<typename Traits>
+	typename BasicValue<Traits>::UInt BasicValue<Traits>::getStringLength() const
 	{
-		if (isString())
+		if (isString() && value_.string_)
 		{
-			return stringlength_;
+			return value_.string_->length_;
 		}
 		return 0;
 	}
 
-	Value::const_iterator Value::begin() const
+	template<typename Traits>
+	typename BasicValue<Traits>::const_iterator BasicValue<Traits>::begin() const
 	{
 		switch (type_)
 		{
 		case listValue:
 		case dictValue:
+			if (value_.map_ && value_.map_->packed_)
+				return const_iterator(value_.map_->elements().data(), value_.map_->elements().data());
 			if (value_.map_)
-				return const_iterator(value_.map_->begin());
+				return const_iterator(value_.map_->map_.begin());
 			break;
 		default:
 			break;
@@ -632,14 +2491,20 @@ namespace Bencode {
 		return const_iterator();
 	}
 
-	Value::const_iterator Value::end() const
+	template<typename Traits>
+	typename BasicValue<Traits>::const_iterator BasicValue<Traits>::end() const
 	{
 		switch (type_)
 		{
 		case listValue:
 		case dictValue:
+			if (value_.map_ && value_.map_->packed_)
+			{
+				const std::vector<Value>& elements = value_.map_->elements();
+				return const_iterator(elements.data(), elements.data() + elements.size());
+			}
 			if (value_.map_)
-				return const_iterator(value_.map_->end());
+				return const_iterator(value_.map_->map_.end());
 			break;
 		default:
 			break;
@@ -647,55 +2512,84 @@ namespace Bencode {
 		return const_iterator();
 	}
 
-	Value::iterator Value::begin()
+	template<typename Traits>
+	typename BasicValue<Traits>::iterator BasicValue<Traits>::begin()
 	{
 		switch (type_)
 		{
 		case listValue:
 		case dictValue:
-			if (value_.map_)
-				return iterator(value_.map_->begin());
-			break;
+			exposeObject();
+			return iterator(value_.map_->map_.begin());
 		default:
 			break;
 		}
 		return iterator();
 	}
 
-	Value::iterator Value::end()
+	template<typename Traits>
+	typename BasicValue<Traits>::iterator BasicValue<Traits>::end()
 	{
 		switch (type_)
 		{
 		case listValue:
 		case dictValue:
-			if (value_.map_)
-				return iterator(value_.map_->end());
-			break;
+			exposeObject();
+			return iterator(value_.map_->map_.end());
 		default:
 			break;
 		}
 		return iterator();
 	}
 
-	Value& Value::resolveReference(const char* key, bool isStatic)
+	template<typename Traits>
+	BasicValue<Traits>& BasicValue<Traits>::resolveReference(const char* key, UInt length, bool isStatic)
 	{
 		// TODO: ڴ˴ return 
 		BENCODE_ASSERT(type_ == nullValue || type_ == dictValue);
 		if (type_ == nullValue)
 			*this = Value(dictValue);
-		CZString actualKey(key, isStatic ? CZString::noDuplication
+		exposeObject();
+		ObjectValues& map = value_.map_->map_;
+		CZString actualKey(key, length, isStatic ? CZString::noDuplication
 			: CZString::duplicateOnCopy);
-		ObjectValues::iterator it = value_.map_->lower_bound(actualKey);
-		if (it != value_.map_->end() && (*it).first == actualKey)
+		typename ObjectValues::iterator it = map.lower_bound(actualKey);
+		if (it != map.end() && (*it).first == actualKey)
 			return (*it).second;
 
-		ObjectValues::value_type defaultValue(actualKey, null);
-		it = value_.map_->insert(it, defaultValue);
+		typename ObjectValues::value_type defaultValue(actualKey, null);
+		it = map.insert(it, defaultValue);
 		Value& value = (*it).second;
 		return value;
 	}
 
 
+	// class MemberLookup
+	// //////////////////////////////////////////////////////////////////
+
+	MemberLookup::MemberLookup(const char* key)
+		: key_(key)
+		, position_(0)
+	{
+	}
+
+	MemberLookup::MemberLookup(const std::string& key)
+		: key_(key)
+		, position_(0)
+	{
+	}
+
+	MemberLookup::MemberLookup(const MemberLookup& other)
+		: key_(other.key_)
+		, position_(other.position_.load(std::memory_order_relaxed))
+	{
+	}
+
+	const std::string& MemberLookup::key() const
+	{
+		return key_;
+	}
+
 	// class PathArgument
 	// //////////////////////////////////////////////////////////////////
 
@@ -705,7 +2599,7 @@ namespace Bencode {
 	}
 
 
-	PathArgument::PathArgument(Value::UInt index)
+	PathArgument::PathArgument(ArrayIndex index)
 		: index_(index)
 		, kind_(kindIndex)
 	{
@@ -761,9 +2655,9 @@ namespace Bencode {
 					addPathInArg(path, in, itInArg, PathArgument::kindIndex);
 				else
 				{
-					Value::UInt index = 0;
+					ArrayIndex index = 0;
 					for (; current != end && *current >= '0' && *current <= '9'; ++current)
-						index = index * 10 + Value::UInt(*current - '0');
+						index = index * 10 + ArrayIndex(*current - '0');
 					args_.push_back(index);
 				}
 				if (current == end || *current++ != ']')
@@ -904,4 +2798,22 @@ namespace Bencode {
 		return *node;
 	}
 
+	template class BasicValue<ValueTraits>;
+	template class BasicValueIteratorBase<ValueTraits>;
+	template class BasicValueConstIterator<ValueTraits>;
+	template class BasicValueIterator<ValueTraits>;
+	template class BasicStringPool<ValueTraits>;
+
+	template class BasicValue<TorrentValueTraits>;
+	template class BasicValueIteratorBase<TorrentValueTraits>;
+	template class BasicValueConstIterator<TorrentValueTraits>;
+	template class BasicValueIterator<TorrentValueTraits>;
+	template class BasicStringPool<TorrentValueTraits>;
+
+	template class BasicValue<KrpcValueTraits>;
+	template class BasicValueIteratorBase<KrpcValueTraits>;
+	template class BasicValueConstIterator<KrpcValueTraits>;
+	template class BasicValueIterator<KrpcValueTraits>;
+	template class BasicStringPool<KrpcValueTraits>;
+
 } // namespace Bencode
@@ -5,47 +5,75 @@
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
-// class ValueIteratorBase
+// class BasicValueIteratorBase
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 
-ValueIteratorBase::ValueIteratorBase()
+template<typename Traits>
+BasicValueIteratorBase<Traits>::BasicValueIteratorBase()
     : current_()
+    , elements_(0)
+    , element_(0)
     , isNull_(true)
 {
 }
 
 
-ValueIteratorBase::ValueIteratorBase(const Value::ObjectValues::iterator& current)
+template<typename Traits>
+BasicValueIteratorBase<Traits>::BasicValueIteratorBase(const typename Value::ObjectValues::iterator& current)
     : current_(current)
+    , elements_(0)
+    , element_(0)
     , isNull_(false)
 {
 }
 
-Value&
-ValueIteratorBase::deref() const
+
+template<typename Traits>
+BasicValueIteratorBase<Traits>::BasicValueIteratorBase(Value* elements, Value* element)
+    : current_()
+    , elements_(elements)
+    , element_(element)
+    , isNull_(false)
 {
+}
+
+template<typename Traits>
+BasicValue<Traits>&
+BasicValueIteratorBase<Traits>::deref() const
+{
+    if (elements_)
+        return *element_;
     return current_->second;
 }
 
 
+template<typename Traits>
 void
-ValueIteratorBase::increment()
+BasicValueIteratorBase<Traits>::increment()
 {
-    ++current_;
+    if (elements_)
+        ++element_;
+    else
+        ++current_;
 }
 
 
+template<typename Traits>
 void
-ValueIteratorBase::decrement()
+BasicValueIteratorBase<Traits>::decrement()
 {
-    --current_;
+    if (elements_)
+        --element_;
+    else
+        --current_;
 }
 
 
-ValueIteratorBase::difference_type
-ValueIteratorBase::computeDistance(const SelfType& other) const
+template<typename Traits>
+typename BasicValueIteratorBase<Traits>::difference_type
+BasicValueIteratorBase<Traits>::computeDistance(const SelfType& other) const
 {
     // Iterator for null value are initialized using the default
     // constructor, which initialize current_ to the default
@@ -57,13 +85,18 @@ ValueIteratorBase::computeDistance(const SelfType& other) const
         return 0;
     }
 
+    if (elements_)
+    {
+        return difference_type(other.element_ - element_);
+    }
+
 
     // Usage of std::distance is not portable (does not compile with Sun Studio 12 RogueWave STL,
     // which is the one used by default).
     // Using a portable hand-made version for non random iterator instead:
     //   return difference_type( std::distance( current_, other.current_ ) );
     difference_type myDistance = 0;
-    for (Value::ObjectValues::iterator it = current_; it != other.current_; ++it)
+    for (typename Value::ObjectValues::iterator it = current_; it != other.current_; ++it)
     {
         ++myDistance;
     }
@@ -71,77 +104,133 @@ ValueIteratorBase::computeDistance(const SelfType& other) const
 }
 
 
+template<typename Traits>
 bool
-ValueIteratorBase::isEqual(const SelfType& other) const
+BasicValueIteratorBase<Traits>::isEqual(const SelfType& other) const
 {
     if (isNull_)
     {
         return other.isNull_;
     }
+    if (elements_)
+    {
+        return element_ == other.element_;
+    }
     return current_ == other.current_;
 }
 
 
+template<typename Traits>
 void
-ValueIteratorBase::copy(const SelfType& other)
+BasicValueIteratorBase<Traits>::copy(const SelfType& other)
 {
     current_ = other.current_;
+    elements_ = other.elements_;
+    element_ = other.element_;
+    isNull_ = other.isNull_;
 }
 
 
-Value
-ValueIteratorBase::key() const
+template<typename Traits>
+int
+BasicValueIteratorBase<Traits>::compareKey(const SelfType& other) const
 {
-    const Value::CZString czstring = (*current_).first;
+    if (!elements_ && !other.elements_)
+    {
+        if (current_->first < other.current_->first)
+            return -1;
+        return other.current_->first < current_->first ? 1 : 0;
+    }
+    UInt index = this->index();
+    UInt otherIndex = other.index();
+    return index < otherIndex ? -1 : index > otherIndex ? 1 : 0;
+}
+
+
+template<typename Traits>
+BasicValue<Traits>
+BasicValueIteratorBase<Traits>::key() const
+{
+    if (elements_)
+        return Value(index());
+    const typename Value::CZString& czstring = (*current_).first;
     if (czstring.c_str())
     {
         if (czstring.isStaticString())
             return Value(StaticString(czstring.c_str()));
-        return Value(czstring.c_str());
+        return Value(czstring.c_str(), czstring.length());
     }
     return Value(czstring.index());
 }
 
 
+template<typename Traits>
 UInt
-ValueIteratorBase::index() const
+BasicValueIteratorBase<Traits>::index() const
 {
-    const Value::CZString czstring = (*current_).first;
+    if (elements_)
+        return UInt(element_ - elements_);
+    const typename Value::CZString& czstring = (*current_).first;
     if (!czstring.c_str())
         return czstring.index();
-    return Value::UInt(-1);
+    return UInt(-1);
 }
 
 
+template<typename Traits>
 const char*
-ValueIteratorBase::memberName() const
+BasicValueIteratorBase<Traits>::memberName() const
 {
+    if (elements_)
+        return "";
     const char* name = (*current_).first.c_str();
     return name ? name : "";
 }
 
 
+template<typename Traits>
+std::string_view
+BasicValueIteratorBase<Traits>::memberNameView() const
+{
+    if (elements_)
+        return std::string_view();
+    const typename Value::CZString& czstring = (*current_).first;
+    if (!czstring.c_str())
+        return std::string_view();
+    return std::string_view(czstring.c_str(), czstring.length());
+}
+
+
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
-// class ValueConstIterator
+// class BasicValueConstIterator
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 
-ValueConstIterator::ValueConstIterator()
+template<typename Traits>
+BasicValueConstIterator<Traits>::BasicValueConstIterator()
+{
+}
+
+template<typename Traits>
+BasicValueConstIterator<Traits>::BasicValueConstIterator(const typename Value::ObjectValues::iterator& current)
+    : BasicValueIteratorBase<Traits>(current)
 {
 }
 
-ValueConstIterator::ValueConstIterator(const Value::ObjectValues::iterator& current)
-    : ValueIteratorBase(current)
+template<typename Traits>
+BasicValueConstIterator<Traits>::BasicValueConstIterator(const Value* elements, const Value* element)
+    : BasicValueIteratorBase<Traits>(const_cast<Value*>(elements), const_cast<Value*>(element))
 {
 }
 
-ValueConstIterator&
-ValueConstIterator::operator =(const ValueIteratorBase& other)
+template<typename Traits>
+BasicValueConstIterator<Traits>&
+BasicValueConstIterator<Traits>::operator =(const BasicValueIteratorBase<Traits>& other)
 {
-    copy(other);
+    this->copy(other);
     return *this;
 }
 
@@ -149,34 +238,41 @@ ValueConstIterator::operator =(const ValueIteratorBase& other)
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
-// class ValueIterator
+// class BasicValueIterator
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 // //////////////////////////////////////////////////////////////////
 
-ValueIterator::ValueIterator()
+template<typename Traits>
+BasicValueIterator<Traits>::BasicValueIterator()
 {
 }
 
 
-ValueIterator::ValueIterator(const Value::ObjectValues::iterator& current)
-    : ValueIteratorBase(current)
+template<typename Traits>
+BasicValueIterator<Traits>::BasicValueIterator(const typename Value::ObjectValues::iterator& current)
+    : BasicValueIteratorBase<Traits>(current)
 {
 }
 
-ValueIterator::ValueIterator(const ValueConstIterator& other)
-    : ValueIteratorBase(other)
+template<typename Traits>
+BasicValueIterator<Traits>::BasicValueIterator(const BasicValueConstIterator<Traits>& other)
+    : BasicValueIteratorBase<Traits>(other)
 {
+    // writes would go to the element nodes built next to the packed arrays, and be lost
+    BENCODE_ASSERT_MESSAGE(!this->elements_, "Can not convert an iterator of a packed list to a mutable one");
 }
 
-ValueIterator::ValueIterator(const ValueIterator& other)
-    : ValueIteratorBase(other)
+template<typename Traits>
+BasicValueIterator<Traits>::BasicValueIterator(const BasicValueIterator& other)
+    : BasicValueIteratorBase<Traits>(other)
 {
 }
 
-ValueIterator&
-ValueIterator::operator =(const SelfType& other)
+template<typename Traits>
+BasicValueIterator<Traits>&
+BasicValueIterator<Traits>::operator =(const SelfType& other)
 {
-    copy(other);
+    this->copy(other);
     return *this;
 }
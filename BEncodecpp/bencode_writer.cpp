@@ -6,102 +6,881 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
 
 #if _MSC_VER >= 1400 // VC++ 8.0
 #pragma warning( disable : 4996 )   // disable warning about strdup being deprecated.
 #endif
 
 namespace Bencode {
-	Writer::Writer()
+
+	// Decimal formatting
+	// //////////////////////////////////////////////////////////////////
+
+	static const std::size_t maxDecimalLength = 20;	// of an unsigned 64-bit integer
+
+	static inline std::size_t decimalLength(unsigned long long value)
 	{
-		document_.clear();
+		std::size_t length = 1;
+		for (;;)
+		{
+			if (value < 10)
+				return length;
+			if (value < 100)
+				return length + 1;
+			if (value < 1000)
+				return length + 2;
+			if (value < 10000)
+				return length + 3;
+			value /= 10000;
+			length += 4;
+		}
+	}
+
+	// Write the digits of value so that they end at end, two at a time;
+	// return the first digit.
+	static inline char* formatDecimal(unsigned long long value, char* end)
+	{
+		static const char digitPairs[] =
+			"00010203040506070809"
+			"10111213141516171819"
+			"20212223242526272829"
+			"30313233343536373839"
+			"40414243444546474849"
+			"50515253545556575859"
+			"60616263646566676869"
+			"70717273747576777879"
+			"80818283848586878889"
+			"90919293949596979899";
+		while (value >= 100)
+		{
+			const char* pair = digitPairs + (value % 100) * 2;
+			value /= 100;
+			*--end = pair[1];
+			*--end = pair[0];
+		}
+		if (value >= 10)
+		{
+			const char* pair = digitPairs + value * 2;
+			*--end = pair[1];
+			*--end = pair[0];
+		}
+		else
+		{
+			*--end = char('0' + value);
+		}
+		return end;
+	}
+
+	// magnitude of value, also for the most negative one
+	static inline unsigned long long magnitude(long long value)
+	{
+		return value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+	}
+
+	// Format i<value>e so that it ends at end; return its first byte.
+	static inline char* formatInt(long long value, char* end)
+	{
+		*--end = 'e';
+		char* begin = formatDecimal(magnitude(value), end);
+		if (value < 0)
+			*--begin = '-';
+		*--begin = 'i';
+		return begin;
+	}
+
+	// Format the <length>: prefix of a string so that it ends at end.
+	static inline char* formatLength(std::size_t length, char* end)
+	{
+		*--end = ':';
+		return formatDecimal(length, end);
 	}
-	UInt Writer::write(const Value& root)
+
+	static inline std::size_t intEncodedSize(long long value)
+	{
+		return 2 + (value < 0 ? 1 : 0) + decimalLength(magnitude(value));
+	}
+
+	static inline std::size_t stringEncodedSize(std::size_t length)
+	{
+		return decimalLength(length) + 1 + length;
+	}
+
+	// class BasicWriter
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	BasicWriter<Traits>::BasicWriter()
+		: sink_(0)
+		, referenceStrings_(true)
+	{
+	}
+
+	template<typename Traits>
+	typename BasicWriter<Traits>::UInt BasicWriter<Traits>::write(const Value& root)
 	{
 		document_.clear();
+		write(root, document_);
+		return UInt(document_.size());
+	}
+
+	template<typename Traits>
+	bool BasicWriter<Traits>::write(const Value& root, OutputSink& sink)
+	{
+		sink_ = &sink;
 		writeValue(root);
-		return document_.size();
+		sink_ = 0;
+		return sink.flush();
 	}
 
-	char* Writer::getCString()
+	template<typename Traits>
+	bool BasicWriter<Traits>::write(Value&& root, OutputSink& sink)
 	{
-		return &document_[0];
+		sink_ = &sink;
+		referenceStrings_ = false;
+		std::vector<Value> open;	// the containers being taken apart, innermost last
+		std::string key;
+		Value node(std::move(root));
+		for (;;)
+		{
+			if (node.isConsumable() && node.encoding().empty())
+			{
+				sink.put(node.type() == dictValue ? 'd' : 'l');
+				open.push_back(std::move(node));
+			}
+			else
+			{
+				writeValue(node);
+				node = Value();
+			}
+			while (!open.empty() && !open.back().popFront(node, key))
+			{
+				sink.put('e');
+				open.pop_back();
+			}
+			if (open.empty())
+				break;
+			if (open.back().type() == dictValue)
+				valueToString(key.data(), UInt(key.length()));
+		}
+		referenceStrings_ = true;
+		sink_ = 0;
+		return sink.flush();
 	}
 
-	void Writer::writeValue(const Value& value)
+	template<typename Traits>
+	char* BasicWriter<Traits>::getCString()
 	{
-		switch (value.type())
+		return document_.data();
+	}
+
+	template<typename Traits>
+	std::string BasicWriter<Traits>::take()
+	{
+		return document_.take();
+	}
+
+	// class BasicWriter::DocumentVisitor
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	class BasicWriter<Traits>::DocumentVisitor
+	{
+	public:
+		explicit DocumentVisitor(BasicWriter& writer)
+			: writer_(writer)
 		{
-		case intValue:
-			valueToString(value.asInt());
-			break;
-		case stringValue:
-			valueToString(value.asCString(), value.getStringLength());
-			break;
-		case listValue:
+		}
+
+		void visitNull(const Value&)
 		{
-			document_.push_back('l');
-			for (auto v : value) {
-				writeValue(v);
+		}
+
+		void visitInt(const Value& node)
+		{
+			writer_.valueToString(node.asInt());
+		}
+
+		void visitString(const Value& node)
+		{
+			std::string_view str = node.asStringView();
+			writer_.valueToString(str.data(), UInt(str.length()));
+		}
+
+		bool beginList(const Value& node)
+		{
+			if (writeEncoding(node))
+				return false;
+			writer_.sink_->put('l');
+			if (!node.isPacked())
+				return true;
+			// written from the packed arrays, without unpacking the list
+			ArrayIndex size = ArrayIndex(node.size());
+			if (const Int* ints = node.packedInts())
+			{
+				for (ArrayIndex index = 0; index < size; ++index)
+					writer_.valueToString(ints[index]);
+			}
+			else
+			{
+				for (ArrayIndex index = 0; index < size; ++index)
+				{
+					std::string_view str = node.packedString(index);
+					writer_.valueToString(str.data(), UInt(str.length()));
+				}
+			}
+			writer_.sink_->put('e');
+			return false;
+		}
+
+		bool beginDict(const Value& node)
+		{
+			if (writeEncoding(node))
+				return false;
+			writer_.sink_->put('d');
+			return true;
+		}
+
+		void visitKey(std::string_view key)
+		{
+			writer_.valueToString(key.data(), UInt(key.length()));
+		}
+
+		void endList(const Value&)
+		{
+			writer_.sink_->put('e');
+		}
+
+		void endDict(const Value&)
+		{
+			writer_.sink_->put('e');
+		}
+
+	private:
+		// an unmodified container is copied as it was read
+		bool writeEncoding(const Value& node)
+		{
+			std::string_view encoding = node.encoding();
+			if (encoding.empty())
+				return false;
+			writer_.writeStored(encoding.data(), encoding.length());
+			return true;
+		}
+
+		BasicWriter& writer_;
+	};
+
+	template<typename Traits>
+	void BasicWriter<Traits>::writeValue(const Value& value)
+	{
+		DocumentVisitor visitor(*this);
+		traversal_.traverse(value, visitor);
+	}
+
+	template<typename Traits>
+	void BasicWriter<Traits>::valueToString(Int value)
+	{
+		char buffer[maxDecimalLength + 3];
+		char* end = buffer + sizeof(buffer);
+		char* begin = formatInt(value, end);
+		sink_->write(begin, std::size_t(end - begin));
+	}
+
+	template<typename Traits>
+	void BasicWriter<Traits>::valueToString(const char* value, UInt length)
+	{
+		char buffer[maxDecimalLength + 1];
+		char* end = buffer + sizeof(buffer);
+		char* begin = formatLength(length, end);
+		sink_->write(begin, std::size_t(end - begin));
+		writeStored(value, length);
+	}
+
+	template<typename Traits>
+	void BasicWriter<Traits>::writeStored(const char* data, std::size_t length)
+	{
+		if (referenceStrings_)
+			sink_->writeReference(data, length);	// stored in the tree: may be referenced
+		else
+			sink_->write(data, length);
+	}
+
+	// class BasicWriter::SizeVisitor
+	// //////////////////////////////////////////////////////////////////
+
+	template<typename Traits>
+	class BasicWriter<Traits>::SizeVisitor
+	{
+	public:
+		SizeVisitor()
+			: size_(0)
+		{
+		}
+
+		void visitNull(const Value&)
+		{
+		}
+
+		void visitInt(const Value& node)
+		{
+			size_ += intEncodedSize(node.asInt());
+		}
+
+		void visitString(const Value& node)
+		{
+			size_ += stringEncodedSize(node.getStringLength());
+		}
+
+		bool beginList(const Value& node)
+		{
+			if (std::size_t length = node.encoding().length())
+			{
+				size_ += length;
+				return false;
+			}
+			size_ += 2;
+			if (!node.isPacked())
+				return true;
+			ArrayIndex size = ArrayIndex(node.size());
+			UInt stride;
+			if (const Int* ints = node.packedInts())
+			{
+				for (ArrayIndex index = 0; index < size; ++index)
+					size_ += intEncodedSize(ints[index]);
+			}
+			else if (node.packedStrings(stride))
+			{
+				size_ += std::size_t(size) * stringEncodedSize(stride);
 			}
-			document_.push_back('e');
+			else
+			{
+				for (ArrayIndex index = 0; index < size; ++index)
+					size_ += stringEncodedSize(node.packedString(index).length());
+			}
+			return false;
 		}
-			break;
-		case dictValue:
+
+		bool beginDict(const Value& node)
 		{
-			Value::Members members(value.getMemberNames());
-			document_.push_back('d');
-			for (auto member:members)
+			if (std::size_t length = node.encoding().length())
 			{
-				valueToString(member);
-				writeValue(value[member]);
+				size_ += length;
+				return false;
 			}
-			document_.push_back('e');
+			size_ += 2;
+			return true;
 		}
-			break;
+
+		void visitKey(std::string_view key)
+		{
+			size_ += stringEncodedSize(key.length());
 		}
+
+		void endList(const Value&)
+		{
+		}
+
+		void endDict(const Value&)
+		{
+		}
+
+		std::size_t size_;
+	};
+
+	template<typename Traits>
+	std::size_t BasicWriter<Traits>::encodedSize(const Value& root)
+	{
+		SizeVisitor visitor;
+		traversal_.traverse(root, visitor);
+		return visitor.size_;
+	}
+
+	// class BasicWriter::ParallelPlan
+	// //////////////////////////////////////////////////////////////////
+
+	// Run task(index, worker) for every index in [0, count), spread over the workers.
+	template<typename Task>
+	static void runParallel(std::size_t count, unsigned int workerCount, Task task)
+	{
+		std::atomic<std::size_t> next(0);
+		std::mutex mutex;
+		std::exception_ptr error;	// the first one thrown, rethrown once all are joined
+		auto work = [&next, count, &task, &mutex, &error](unsigned int worker)
+		{
+			try
+			{
+				for (std::size_t index = next.fetch_add(1); index < count; index = next.fetch_add(1))
+					task(index, worker);
+			}
+			catch (...)
+			{
+				next.store(count);
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+		};
+		std::vector<std::thread> threads;
+		for (unsigned int worker = 1; worker < workerCount && worker < count; ++worker)
+			threads.push_back(std::thread(work, worker));
+		work(0);
+		for (std::size_t index = 0; index < threads.size(); ++index)
+			threads[index].join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	/* The output cut into segments in document order: the bytes that open
+	 * and close the descended containers, the keys of their descended
+	 * members, and runs of consecutive members that one worker encodes.
+	 * The runs are sized first, so that each is then encoded in place in
+	 * the output.
+	 */
+	template<typename Traits>
+	class BasicWriter<Traits>::ParallelPlan
+	{
+	public:
+		class Segment
+		{
+		public:
+			const Value* container_;	// of the run; 0 for a fixed text
+			typename Value::const_iterator first_;
+			typename Value::const_iterator last_;
+			std::string text_;	// the fixed text
+			std::size_t size_;	// of the encoding
+			std::size_t offset_;	// in the output
+		};
+
+		ParallelPlan(unsigned int workerCount, std::size_t runCount)
+			: writers_(workerCount)
+			, runCount_(runCount)
+		{
+		}
+
+		static bool isSplittable(const Value& node)
+		{
+			return (node.type() == listValue || node.type() == dictValue)
+				&& !node.isPacked() && node.size() > 1 && node.encoding().empty();
+		}
+
+		/// Append the segments of root. A container with at least as many
+		/// members as runs wanted is cut into runs of size() / runCount
+		/// members. A smaller one has its splittable members descended into,
+		/// down to maxSplitDepth levels, and its other members grouped into
+		/// runs of consecutive members; below that depth a subtree is left
+		/// whole in a run. The pending levels are kept on an explicit stack,
+		/// as in Traversal.
+		void split(const Value& root)
+		{
+			std::vector<Frame> stack;
+			open(root, stack);
+			while (!stack.empty())
+			{
+				Frame& frame = stack.back();
+				if (frame.current_ == frame.end_)
+				{
+					addRun(*frame.container_, frame.runFirst_, frame.end_);
+					addText("e");
+					stack.pop_back();
+					continue;
+				}
+				typename Value::const_iterator member = frame.current_;
+				++frame.current_;
+				if (stack.size() >= maxSplitDepth || !isSplittable(*member))
+					continue;	// part of the pending run
+				const Value& container = *frame.container_;
+				addRun(container, frame.runFirst_, member);
+				frame.runFirst_ = frame.current_;
+				if (container.type() == dictValue)
+					addKey(member.memberNameView());
+				open(*member, stack);	// may grow stack: frame is not used past this point
+			}
+		}
+
+		/// Size the runs in parallel, place the segments, then encode the
+		/// runs in parallel, each where it goes in output.
+		void write(StringSink& output)
+		{
+			std::vector<Segment*> runs;
+			for (std::size_t index = 0; index < segments_.size(); ++index)
+			{
+				if (segments_[index].container_)
+					runs.push_back(&segments_[index]);
+			}
+			runParallel(runs.size(), unsigned(writers_.size()),
+				[this, &runs](std::size_t index, unsigned int worker)
+				{
+					Segment& run = *runs[index];
+					bool isDict = run.container_->type() == dictValue;
+					SizeVisitor visitor;
+					for (typename Value::const_iterator it = run.first_; it != run.last_; ++it)
+					{
+						if (isDict)
+							visitor.visitKey(it.memberNameView());
+						writers_[worker].traversal_.traverse(*it, visitor);
+					}
+					run.size_ = visitor.size_;
+				});
+
+			std::size_t total = 0;
+			for (std::size_t index = 0; index < segments_.size(); ++index)
+			{
+				Segment& segment = segments_[index];
+				if (!segment.container_)
+					segment.size_ = segment.text_.length();
+				segment.offset_ = total;
+				total += segment.size_;
+			}
+			output.clear();
+			char* data = output.extend(total);
+			for (std::size_t index = 0; index < segments_.size(); ++index)
+			{
+				const Segment& segment = segments_[index];
+				if (!segment.container_)
+					memcpy(data + segment.offset_, segment.text_.data(), segment.size_);
+			}
+
+			runParallel(runs.size(), unsigned(writers_.size()),
+				[this, &runs, data](std::size_t index, unsigned int worker)
+				{
+					const Segment& run = *runs[index];
+					bool isDict = run.container_->type() == dictValue;
+					BasicWriter& writer = writers_[worker];
+					BufferSink sink(data + run.offset_, run.size_);
+					writer.sink_ = &sink;
+					for (typename Value::const_iterator it = run.first_; it != run.last_; ++it)
+					{
+						if (isDict)
+						{
+							std::string_view key = it.memberNameView();
+							writer.valueToString(key.data(), UInt(key.length()));
+						}
+						writer.writeValue(*it);
+					}
+					writer.sink_ = 0;
+					if (sink.required() != run.size_)
+						throw std::logic_error("Bencode::Writer::writeParallel: root modified during the call");
+				});
+		}
+
+	private:
+		void addText(std::string_view text)
+		{
+			if (!segments_.empty() && !segments_.back().container_)
+			{
+				segments_.back().text_.append(text.data(), text.length());
+				return;
+			}
+			segments_.push_back(Segment());
+			segments_.back().container_ = 0;
+			segments_.back().text_.assign(text.data(), text.length());
+		}
+
+		void addKey(std::string_view key)
+		{
+			char prefix[maxDecimalLength + 1];
+			char* end = prefix + sizeof(prefix);
+			char* begin = formatLength(key.length(), end);
+			addText(std::string_view(begin, std::size_t(end - begin)));
+			addText(key);
+		}
+
+		// a container being descended into, with the members not descended into yet
+		class Frame
+		{
+		public:
+			const Value* container_;
+			typename Value::const_iterator current_;
+			typename Value::const_iterator end_;
+			typename Value::const_iterator runFirst_;	// of the members waiting for a run
+		};
+
+		// levels descended into at most: deeper subtrees are not worth cutting
+		static const std::size_t maxSplitDepth = 8;
+
+		/// Open container: cut it into runs if it is large enough, or push it on stack.
+		void open(const Value& container, std::vector<Frame>& stack)
+		{
+			addText(container.type() == dictValue ? "d" : "l");
+			std::size_t size = container.size();
+			if (size < runCount_)
+			{
+				Frame frame;
+				frame.container_ = &container;
+				frame.current_ = container.begin();
+				frame.end_ = container.end();
+				frame.runFirst_ = frame.current_;
+				stack.push_back(frame);
+				return;
+			}
+			std::size_t runLength = size / runCount_;
+			typename Value::const_iterator first = container.begin();
+			std::size_t index = 0;
+			for (typename Value::const_iterator it = first; it != container.end(); ++it)
+			{
+				if (++index % runLength == 0)
+				{
+					typename Value::const_iterator last = it;
+					++last;
+					addRun(container, first, last);
+					first = last;
+				}
+			}
+			addRun(container, first, container.end());
+			addText("e");
+		}
+
+		void addRun(const Value& container, typename Value::const_iterator first, typename Value::const_iterator last)
+		{
+			if (first == last)
+				return;
+			segments_.push_back(Segment());
+			Segment& segment = segments_.back();
+			segment.container_ = &container;
+			segment.first_ = first;
+			segment.last_ = last;
+		}
+
+		std::vector<BasicWriter> writers_;	// one per worker
+		std::vector<Segment> segments_;
+		std::size_t runCount_;	// wanted per container
+	};
+
+	template<typename Traits>
+	typename BasicWriter<Traits>::UInt BasicWriter<Traits>::writeParallel(const Value& root, unsigned int threadCount)
+	{
+		if (threadCount == 0)
+			threadCount = std::thread::hardware_concurrency();
+		if (threadCount <= 1 || !ParallelPlan::isSplittable(root))
+			return write(root);
+
+		// several runs per thread, so that uneven ones even out
+		ParallelPlan plan(threadCount, threadCount * 8);
+		plan.split(root);
+		plan.write(document_);
+		return UInt(document_.size());
+	}
+
+	template class BasicWriter<ValueTraits>;
+	template class BasicWriter<TorrentValueTraits>;
+	template class BasicWriter<KrpcValueTraits>;
+
+	// class Encoder
+	// //////////////////////////////////////////////////////////////////
+
+	Encoder::Encoder(OutputSink& sink, std::size_t sortBufferSize)
+		: sink_(sink)
+		, sortBufferSize_(sortBufferSize)
+		, depth_(0)
+		, bufferedDepth_(0)
+		, done_(false)
+	{
+	}
+
+	void Encoder::beginDict()
+	{
+		beginContainer(true);
+	}
+
+	void Encoder::beginList()
+	{
+		beginContainer(false);
+	}
+
+	void Encoder::end()
+	{
+		if (depth_ == 0)
+			fail("end() without an open dict or list");
+		Frame& frame = frames_[depth_ - 1];
+		if (frame.hasKey_)
+			fail("dict member without a value");
+		if (frame.buffered_ && !frame.sorted_)
+		{
+			sortMembers(frame);
+			frame.sorted_ = true;	// the 'e' may spill the buffer
+		}
+		emit("e", 1);
+		--depth_;
+		if (frame.buffered_)
+		{
+			frame.buffered_ = false;
+			frame.members_.clear();
+			if (--bufferedDepth_ == 0)
+			{
+				sink_.write(buffer_.data(), buffer_.size());
+				buffer_.clear();
+			}
+		}
+		if (depth_ == 0)
+			done_ = true;
+	}
+
+	void Encoder::key(std::string_view name)
+	{
+		if (depth_ == 0 || !frames_[depth_ - 1].isDict_)
+			fail("key() outside of a dict");
+		Frame& frame = frames_[depth_ - 1];
+		if (frame.hasKey_)
+			fail("two keys without a value");
+		if (frame.hasLastKey_ && frame.sorted_ && name <= std::string_view(frame.lastKey_))
+		{
+			if (!frame.buffered_)
+				fail(name == std::string_view(frame.lastKey_) ? "duplicate dict key" : "dict keys out of order");
+			frame.sorted_ = false;	// sorted at the end of the dict
+		}
+		if (frame.sorted_)
+		{
+			frame.lastKey_.assign(name.data(), name.length());
+			frame.hasLastKey_ = true;
+		}
+		frame.hasKey_ = true;
+
+		char prefix[maxDecimalLength + 1];
+		char* end = prefix + sizeof(prefix);
+		char* begin = formatLength(name.length(), end);
+		if (frame.buffered_)
+		{
+			Member member;
+			member.start_ = buffer_.size();
+			member.keyStart_ = member.start_ + std::size_t(end - begin);
+			member.keyLength_ = name.length();
+			frame.members_.push_back(member);
+		}
+		emit(begin, std::size_t(end - begin));
+		emit(name.data(), name.length());
+	}
+
+	void Encoder::integer(Int value)
+	{
+		beginValue();
+		char buffer[maxDecimalLength + 3];
+		char* end = buffer + sizeof(buffer);
+		char* begin = formatInt(value, end);
+		emit(begin, std::size_t(end - begin));
+	}
+
+	void Encoder::string(std::string_view value)
+	{
+		beginValue();
+		char prefix[maxDecimalLength + 1];
+		char* end = prefix + sizeof(prefix);
+		char* begin = formatLength(value.length(), end);
+		emit(begin, std::size_t(end - begin));
+		emit(value.data(), value.length());
+	}
+
+	bool Encoder::finish()
+	{
+		if (depth_ != 0)
+			fail("finish() with an open dict or list");
+		if (!done_)
+			fail("finish() without a value");
+		return sink_.flush();
 	}
 
-	void Writer::valueToString(Int value)
+	// Check that a value is expected here.
+	void Encoder::beginValue()
 	{
-		int n = 0;
-		int temp = value;
-		bool isNegative = value < 0;
-		while (temp != 0)
+		if (depth_ == 0)
 		{
-			temp /= 10;
-			++n;
+			if (done_)
+				fail("more than one top-level value");
+			done_ = true;	// a scalar root; containers are done at their end()
+			return;
 		}
-		if (isNegative)
+		Frame& frame = frames_[depth_ - 1];
+		if (frame.isDict_)
 		{
-			++n;
+			if (!frame.hasKey_)
+				fail("dict member without a key");
+			frame.hasKey_ = false;
 		}
-		UInt current = document_.size();
-		document_.resize(current + n + 2);
-		document_[current++] = 'i';
-		itoa(value, &document_[current], 10);
-		document_[current + n] = 'e';
 	}
 
-	void Writer::valueToString(std::string str)
+	void Encoder::beginContainer(bool isDict)
 	{
-		valueToString(str.c_str(), str.length());
+		beginValue();
+		done_ = false;
+		emit(isDict ? "d" : "l", 1);
+		if (depth_ == frames_.size())
+			frames_.push_back(Frame());
+		Frame& frame = frames_[depth_++];
+		frame.isDict_ = isDict;
+		frame.hasKey_ = false;
+		frame.buffered_ = isDict && sortBufferSize_ != 0;
+		frame.sorted_ = true;
+		frame.hasLastKey_ = false;
+		if (frame.buffered_)
+		{
+			++bufferedDepth_;
+			frame.contentStart_ = buffer_.size();
+		}
 	}
 
-	void Writer::valueToString(const char* value, UInt length)
+	// Rewrite the members of a buffered dict in key order.
+	void Encoder::sortMembers(Frame& frame)
 	{
-		int n = 0;
-		int temp = length;
-		while (temp != 0)
+		const char* data = buffer_.data();
+		std::vector<Member> members(frame.members_);
+		std::sort(members.begin(), members.end(), [data](const Member& a, const Member& b)
+			{
+				return std::string_view(data + a.keyStart_, a.keyLength_)
+					< std::string_view(data + b.keyStart_, b.keyLength_);
+			});
+		std::string sorted;
+		sorted.reserve(buffer_.size() - frame.contentStart_);
+		for (std::size_t index = 0; index < members.size(); ++index)
 		{
-			temp /= 10;
-			++n;
+			const Member& member = members[index];
+			if (index > 0 && std::string_view(data + member.keyStart_, member.keyLength_)
+				== std::string_view(data + members[index - 1].keyStart_, members[index - 1].keyLength_))
+				fail("duplicate dict key");
+			// a member runs up to the start of the next one in input order
+			std::vector<Member>::const_iterator next = std::upper_bound(frame.members_.begin(), frame.members_.end(),
+				member.start_, [](std::size_t start, const Member& other) { return start < other.start_; });
+			std::size_t memberEnd = next == frame.members_.end() ? buffer_.size() : next->start_;
+			sorted.append(data + member.start_, memberEnd - member.start_);
 		}
-		UInt current = document_.size();
-		document_.resize(current + n + 1 + length);
-		itoa(length, &document_[current], 10);
-		current += n;
-		document_[current++] = ':';
-		memcpy(&document_[current], value, length);
+		buffer_.replace(frame.contentStart_, std::string::npos, sorted);
+	}
+
+	void Encoder::emit(const char* data, std::size_t length)
+	{
+		if (bufferedDepth_ == 0)
+		{
+			sink_.write(data, length);
+			return;
+		}
+		buffer_.append(data, length);
+		if (buffer_.size() > sortBufferSize_)
+			spill();
+	}
+
+	// The buffer is full: write it out if every buffered dict is in order so far.
+	void Encoder::spill()
+	{
+		for (std::size_t index = 0; index < depth_; ++index)
+		{
+			if (frames_[index].buffered_ && !frames_[index].sorted_)
+				fail("dict keys out of order exceed the sort buffer");
+		}
+		sink_.write(buffer_.data(), buffer_.size());
+		buffer_.clear();
+		for (std::size_t index = 0; index < depth_; ++index)
+		{
+			frames_[index].buffered_ = false;
+			frames_[index].members_.clear();
+		}
+		bufferedDepth_ = 0;
+	}
+
+	void Encoder::fail(const char* message)
+	{
+		throw std::runtime_error(std::string("Bencode::Encoder: ") + message);
 	}
 } // namespace Bencode
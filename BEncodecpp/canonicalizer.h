@@ -0,0 +1,107 @@
+#ifndef BENCODE_CANONICALIZER_H_INCLUDE
+#define BENCODE_CANONICALIZER_H_INCLUDE
+
+#include "sink.h"
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace Bencode {
+
+	/** \brief Rewrites a bencoded document in canonical form, without building a Value tree.
+	 *
+	 * The canonical form has integers and string lengths without leading
+	 * zeros (nor "-0"), and dict members in increasing byte order of their
+	 * names, each name once; of duplicate members, the last one is kept, as
+	 * Reader does. Names are compared as bytes, so that names holding '\0'
+	 * or any binary data are ordered correctly.
+	 *
+	 * The input is scanned once. Canonical regions are written straight from
+	 * it, and only the tokens that change are rewritten; a dict out of order
+	 * costs a description of where its members are, not a copy of them.
+	 *
+	 * \code
+	 * Bencode::Canonicalizer canonicalizer;
+	 * if (!canonicalizer.check(begin, end))
+	 *     std::cerr << canonicalizer.error();
+	 * else if (canonicalizer.changed())
+	 *     canonicalizer.run(begin, end, sink);
+	 * \endcode
+	 */
+	class Canonicalizer
+	{
+	public:
+		Canonicalizer();
+
+		/// Write the canonical form of the document in [begin, end) to sink,
+		/// then flush the sink. The input is given to sink.writeReference(),
+		/// so it must stay valid until the output has been consumed.
+		/// \return false if the input is not valid bencode or the sink failed.
+		bool run(const char* begin, const char* end, OutputSink& sink);
+
+		/// Same as run(const char*, const char*, OutputSink&), writing nothing:
+		/// only changed() and error() are set.
+		bool check(const char* begin, const char* end);
+
+		/// true if the document of the last run() or check() was not canonical.
+		bool changed() const;
+
+		/// Why the last run() or check() failed, with the offset in the input.
+		const std::string& error() const;
+
+	private:
+		// a part of the output: bytes of the input, or static text replacing some
+		class Piece
+		{
+		public:
+			const char* data_;
+			std::size_t length_;
+			bool rewritten_;
+		};
+
+		// position in the output where a member of an open dict starts
+		class Member
+		{
+		public:
+			const char* name_;
+			std::size_t nameLength_;
+			std::size_t piece_;	// pieces_.size() then
+			const char* position_;	// in the input, at or after runStart_ then
+		};
+
+		// an open list or dict
+		class Frame
+		{
+		public:
+			bool isDict_;
+			bool ordered_;	// names strictly increasing so far
+			std::size_t membersBegin_;	// in members_
+		};
+
+		Canonicalizer(const Canonicalizer&);
+		Canonicalizer& operator=(const Canonicalizer&);
+
+		bool scan(const char* begin, const char* end);
+		bool readInteger(const char*& current, const char* end);
+		bool readString(const char*& current, const char* end, const char** data, std::size_t* length);
+		void replace(const char* begin, const char* end, const char* text);
+		void closeRun(const char* position);
+		void reorder(const char* position);
+		bool fail(const char* position, const char* message);
+
+		const char* begin_;	// of the input
+		const char* runStart_;	// of the input bytes not in pieces_ yet
+		std::vector<Piece> pieces_;
+		std::vector<Member> members_;
+		std::vector<Frame> frames_;
+		// used by reorder(), kept to reuse the memory
+		std::vector<Piece> cut_;
+		std::vector<std::size_t> bounds_;
+		std::vector<std::size_t> order_;
+		bool changed_;
+		std::string error_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_CANONICALIZER_H_INCLUDE
@@ -0,0 +1,159 @@
+#ifndef BENCODE_FILTER_H_INCLUDE
+#define BENCODE_FILTER_H_INCLUDE
+
+#include "value.h"
+#include "sink.h"
+#include "writer.h"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <iosfwd>
+#include <cstddef>
+#include <type_traits>
+
+namespace Bencode {
+
+	/** \brief Streaming bencode-to-bencode transformation, without building a Value tree.
+	 *
+	 * The input is scanned once and written to a sink as it is read. Values
+	 * no rule applies to are copied byte for byte, dropped values are passed
+	 * over (strings in one step, by their length), and only the lists and
+	 * dicts on the way to a rule are taken apart, so that filtering costs
+	 * little more than copying the input.
+	 *
+	 * \code
+	 * Bencode::Filter filter;
+	 * filter.drop(".info.pieces");
+	 * filter.drop(".info.private");
+	 * filter.replace(".announce", Bencode::Value("http://tracker.example/announce"));
+	 * if (!filter.run(begin, end, sink))
+	 *     std::cerr << filter.error();
+	 * \endcode
+	 *
+	 * Paths use the Query syntax restricted to ".name", "['name']", "[n]",
+	 * ".*" and "[*]"; "." is the root. Once keep() has been called, only the
+	 * kept values and the containers leading to them are written; drop()
+	 * and replace() still apply inside kept values.
+	 *
+	 * Members are never reordered (renaming one would require its dict to be
+	 * buffered), so the output is canonical if the input is. A Filter can be
+	 * run any number of times, but not concurrently.
+	 *
+	 * Values copied or dropped whole are still checked as they are passed
+	 * over: integers must have no leading zeros and no "-0", and member names
+	 * must be strings. The order of the names is not checked.
+	 */
+	class Filter
+	{
+	public:
+		enum Action
+		{
+			actionCopy = 0,	///< write the value as it was read
+			actionDescend,	///< apply the rules and the callback to its members (actionCopy for a scalar)
+			actionDrop,		///< leave the value out, with its name in a dict
+			actionReplace	///< write a replacement instead
+		};
+
+		/// A member name or a list index on the path to a value.
+		class Step
+		{
+		public:
+			std::string key_;
+			ArrayIndex index_;
+			bool isIndex_;
+		};
+		typedef std::vector<Step> Steps;
+
+		Filter();
+		~Filter();
+
+		/// \throw std::runtime_error if path is invalid.
+		void drop(const std::string& path);
+		/// \throw std::runtime_error if path is invalid.
+		void keep(const std::string& path);
+		/// Write value instead of the values at path; a null value drops them.
+		/// \throw std::runtime_error if path is invalid.
+		void replace(const std::string& path, const Value& value);
+
+		/// Filter the document in [begin, end) to sink, then flush the sink.
+		/// \return false if the input is not valid bencode or the sink failed.
+		bool run(const char* begin, const char* end, OutputSink& sink);
+		/// Same as run(const char*, const char*, OutputSink&), reading the
+		/// document from in through a fixed-size buffer.
+		bool run(std::istream& in, OutputSink& sink);
+
+		/** \brief Same as run(const char*, const char*, OutputSink&), with the
+		 * rules refined by callback.
+		 *
+		 * Action callback(const Steps& path, ValueType type, Value& replacement)
+		 * is called for each value the rules would copy or descend into, and
+		 * decides instead; for actionReplace it stores the value to write in
+		 * replacement (null drops the value). It is not called inside copied,
+		 * dropped or replaced values.
+		 */
+		template<typename Callback>
+		bool run(const char* begin, const char* end, OutputSink& sink, Callback&& callback)
+		{
+			return runRange(begin, end, sink, &invoke<typename std::remove_reference<Callback>::type>, &callback);
+		}
+
+		/// Same as run(std::istream&, OutputSink&), with the callback of
+		/// run(const char*, const char*, OutputSink&, Callback&&).
+		template<typename Callback>
+		bool run(std::istream& in, OutputSink& sink, Callback&& callback)
+		{
+			return runStream(in, sink, &invoke<typename std::remove_reference<Callback>::type>, &callback);
+		}
+
+		/// Why the last run() failed, with the offset in the input.
+		const std::string& error() const;
+
+	private:
+		typedef Action (*Decide)(void* context, const Steps& path, ValueType type, Value& replacement);
+
+		template<typename Callback>
+		static Action invoke(void* context, const Steps& path, ValueType type, Value& replacement)
+		{
+			return (*static_cast<Callback*>(context))(path, type, replacement);
+		}
+
+		class Rule;
+		class Parser;
+		class Input;
+
+		// a list or dict being taken apart
+		class Frame
+		{
+		public:
+			bool isDict_;
+			bool kept_;
+			ArrayIndex index_;	// of the next element
+			std::size_t activeBegin_;	// rules of the container in active_
+			std::size_t activeEnd_;
+		};
+
+		Filter(const Filter&);
+		Filter& operator=(const Filter&);
+
+		Rule& rule(const std::string& path, bool keep);
+		bool runRange(const char* begin, const char* end, OutputSink& sink, Decide decide, void* context);
+		bool runStream(std::istream& in, OutputSink& sink, Decide decide, void* context);
+		bool transcode(Input& input, OutputSink& sink, Decide decide, void* context);
+		Action decideRules(std::size_t activeBegin, bool& kept, bool isContainer,
+			std::string_view& replacement) const;
+		bool fail(const Input& input, const char* message);
+
+		std::unique_ptr<Rule> root_;
+		bool keepMode_;	// keep() was called
+		// state of run(), kept to reuse the memory
+		std::vector<const Rule*> active_;	// rules matching the path of each open container, then of the value
+		std::vector<Frame> frames_;
+		Steps steps_;	// maintained for the callback only
+		Writer writer_;	// encodes the replacements
+		std::string error_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_FILTER_H_INCLUDE
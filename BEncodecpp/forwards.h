@@ -6,22 +6,53 @@ namespace Bencode {
 	// writer.h
 	//class FastWriter;
 	//class StyledWriter;
-	class Writer;
+	template<typename Traits> class BasicWriter;
+	class Encoder;
 
 	// reader.h
-	class Reader;
+	class Features;
+	template<typename Traits> class BasicReader;
+
+	// sink.h
+	class OutputSink;
+
+	// filter.h
+	class Filter;
+
+	// canonicalizer.h
+	class Canonicalizer;
 
 
 	// value.h
 	typedef int Int;
 	typedef unsigned int UInt;
+	typedef unsigned int ArrayIndex;
 	class StaticString;
 	class Path;
 	class PathArgument;
-	class Value;
-	class ValueIteratorBase;
-	class ValueIterator;
-	class ValueConstIterator;
+	class MemberLookup;
+	class FrozenValue;
+	class Query;
+	class Reclaimer;
+	class ValueTraits;
+	class TorrentValueTraits;
+	class KrpcValueTraits;
+	template<typename Traits> class BasicStringPool;
+	template<typename Traits> class BasicTraversal;
+	template<typename Traits> class BasicValue;
+	template<typename Traits> class BasicValueIteratorBase;
+	template<typename Traits> class BasicValueIterator;
+	template<typename Traits> class BasicValueConstIterator;
+
+	// The default instantiations.
+	typedef BasicValue<ValueTraits> Value;
+	typedef BasicValueIteratorBase<ValueTraits> ValueIteratorBase;
+	typedef BasicValueIterator<ValueTraits> ValueIterator;
+	typedef BasicValueConstIterator<ValueTraits> ValueConstIterator;
+	typedef BasicStringPool<ValueTraits> StringPool;
+	typedef BasicTraversal<ValueTraits> Traversal;
+	typedef BasicReader<ValueTraits> Reader;
+	typedef BasicWriter<ValueTraits> Writer;
 
 } // namespace Bencode
 
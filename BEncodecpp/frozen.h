@@ -0,0 +1,79 @@
+#ifndef BENCODE_FROZEN_H_INCLUDE
+#define BENCODE_FROZEN_H_INCLUDE
+
+#include "value.h"
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+
+namespace Bencode {
+
+	/** \brief Compact immutable snapshot of a Value tree, thawed on first access.
+	 *
+	 * The tree is encoded into a single block: integers and lengths as
+	 * varints, and every string or member name seen before as a reference
+	 * to its first occurrence. Cold documents kept as FrozenValue hold only
+	 * that block.
+	 *
+	 * value() decodes the block into a live Value the first time it is
+	 * called and returns the same Value afterwards; strings repeated in the
+	 * document share one payload in the thawed tree. freeze() drops the live
+	 * tree again, keeping the block.
+	 *
+	 * value() may be called concurrently; freeze() may not.
+	 */
+	class FrozenValue
+	{
+	public:
+		/** \brief Global count of FrozenValue accesses.
+		 */
+		class Counters
+		{
+		public:
+			Counters()
+				: hits_(0)
+				, misses_(0)
+			{
+			}
+
+			std::atomic<long long> hits_;	// value() served by the live tree
+			std::atomic<long long> misses_;	// value() had to thaw the block
+		};
+
+		/// \brief Install counters updated on every value() call, or 0 to stop counting.
+		static void setCounters(Counters* counters);
+		static Counters* counters();
+
+		FrozenValue();
+		explicit FrozenValue(const Value& value);
+
+		/// The live tree, thawed from the block on first access.
+		/// \throw std::runtime_error if the block is malformed; value() then stays null.
+		const Value& value() const;
+
+		/// true if value() currently returns without decoding.
+		bool isThawed() const;
+
+		/// Drop the live tree; the next value() thaws the block again.
+		void freeze();
+
+		/// Size in bytes of the encoded block.
+		std::size_t frozenSize() const;
+
+	private:
+		FrozenValue(const FrozenValue&);
+		FrozenValue& operator=(const FrozenValue&);
+
+		class Encoder;
+		class Decoder;
+
+		std::vector<unsigned char> block_;
+		mutable Value value_;
+		mutable std::atomic<bool> thawed_;
+		mutable std::mutex mutex_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_FROZEN_H_INCLUDE
@@ -0,0 +1,153 @@
+#ifndef BENCODE_QUERY_H_INCLUDE
+#define BENCODE_QUERY_H_INCLUDE
+
+#include "value.h"
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <type_traits>
+
+namespace Bencode {
+
+	/** \brief Compiled query selecting nodes of a Value tree.
+	 *
+	 * The expression is parsed once; the compiled Query is immutable and can
+	 * be evaluated against any number of documents, concurrently.
+	 *
+	 * Syntax (a superset of Path):
+	 * - "." => root node
+	 * - ".name" or "['name']" => member named 'name' (quotes allow any byte but ')
+	 * - "[n]" => element at index 'n'
+	 * - ".*" or "[*]" => every list element or dict member
+	 * - "..name" => member named 'name' of the node or any of its descendants
+	 * - "..*" => every descendant
+	 * - "[?(.rel op literal)]" => children for which the relative path 'rel'
+	 *   compares true against an integer or 'quoted' string literal;
+	 *   op is one of == != < <= > >=. "[?(.rel)]" only tests existence.
+	 *
+	 * Examples: ".info.files[*].length", ".announce-list[*][*]",
+	 * ".info.files[?(.length>1048576)].path".
+	 *
+	 * Results are streamed to the callback in document order as references
+	 * into the evaluated tree. Evaluation is not recursive: the levels being
+	 * searched are kept on a stack allocated once per evaluate() call (per
+	 * thread for evaluateParallel()). The only other allocation is that of
+	 * the element nodes of a packed list the first time a step iterates it
+	 * or indexes into it (see Value::pack()).
+	 */
+	class Query
+	{
+	public:
+		/// \throw std::runtime_error if expression is not a valid query.
+		explicit Query(const std::string& expression);
+
+		/// Call callback(const Value& node) for every node matched in root.
+		template<typename Callback>
+		void evaluate(const Value& root, Callback&& callback) const
+		{
+			auto adapter = [&callback](std::size_t, const Value& node) { callback(node); };
+			run(&root, 1, &invoke<decltype(adapter)>, &adapter);
+		}
+
+		/// Call callback(std::size_t rootIndex, const Value& node) for every node
+		/// matched in roots[0..count).
+		template<typename Callback>
+		void evaluate(const Value* roots, std::size_t count, Callback&& callback) const
+		{
+			run(roots, count, &invoke<typename std::remove_reference<Callback>::type>, &callback);
+		}
+
+		/// \brief Same as evaluate(roots, count, callback), with the batch split
+		/// across threadCount threads (0 = hardware concurrency).
+		///
+		/// Results of one root are delivered in order by a single thread, but
+		/// callback is invoked concurrently for different roots and must be
+		/// thread-safe. If it throws, the other threads stop at their next
+		/// root and the first exception is rethrown once all have joined.
+		template<typename Callback>
+		void evaluateParallel(const Value* roots, std::size_t count, Callback&& callback,
+			unsigned int threadCount = 0) const
+		{
+			runParallel(roots, count, &invoke<typename std::remove_reference<Callback>::type>,
+				&callback, threadCount);
+		}
+
+		/// Return the first node matched in root, or 0 if nothing matches.
+		const Value* first(const Value& root) const;
+
+	private:
+		/// Receives one result; returning false stops the evaluation.
+		typedef bool (*Sink)(void* context, std::size_t rootIndex, const Value& node);
+
+		template<typename Callback>
+		static bool invoke(void* context, std::size_t rootIndex, const Value& node)
+		{
+			(*static_cast<Callback*>(context))(rootIndex, node);
+			return true;
+		}
+
+		enum CompareOp
+		{
+			opExists = 0,
+			opEqual,
+			opNotEqual,
+			opLess,
+			opLessEqual,
+			opGreater,
+			opGreaterEqual
+		};
+
+		class Step
+		{
+		public:
+			enum Kind
+			{
+				kindKey = 0,
+				kindIndex,
+				kindWildcard,
+				kindDescendantKey,
+				kindDescendantAll,
+				kindFilter
+			};
+
+			Kind kind_;
+			std::string key_;
+			ArrayIndex index_;
+			// kindFilter only
+			std::vector<Step> filterPath_;
+			CompareOp op_;
+			Value literal_;
+		};
+		typedef std::vector<Step> Steps;
+
+		/// A node whose children are being matched against the step at index step_.
+		class Frame
+		{
+		public:
+			const Value* node_;
+			std::size_t step_;
+			Value::const_iterator current_;
+			Value::const_iterator end_;
+			bool lookupPending_;	// kindDescendantKey: node_'s own member not matched yet
+		};
+		typedef std::vector<Frame> Frames;
+
+		class Parser;
+
+		void run(const Value* roots, std::size_t count, Sink sink, void* context) const;
+		void runParallel(const Value* roots, std::size_t count, Sink sink, void* context,
+			unsigned int threadCount) const;
+		bool match(const Value& root, std::size_t rootIndex, Sink sink, void* context,
+			Frames& stack) const;
+		bool enter(const Value& node, std::size_t step, std::size_t rootIndex,
+			Sink sink, void* context, Frames& stack) const;
+		void push(const Value& node, std::size_t step, Frames& stack) const;
+		static const Value* resolveSimple(const Value& node, const Steps& path, Value& element);
+		static bool test(const Value& node, const Step& filter);
+
+		Steps steps_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_QUERY_H_INCLUDE
@@ -6,9 +6,64 @@
 #include <stack>
 #include <string>
 #include <iostream>
+#include <unordered_set>
+#include <cstddef>
 
 namespace Bencode {
-	class Reader {
+
+    /** \brief Configuration passed to reader that determines how documents are
+     * loaded into Values.
+     */
+    class Features
+    {
+    public:
+        /** \brief A configuration with every option at its default.
+         * \code
+         * Features::all()
+         * \endcode
+         */
+        static Features all();
+
+        /** \brief A configuration for documents kept in a long-lived cache.
+         *
+         * Same as all(), with string values interned in the StringPool and
+         * identical subtrees shared.
+         */
+        static Features cached();
+
+        /** \brief Initialize the configuration like Features::all().
+         */
+        Features();
+
+        /// \c true if string values are shared through the StringPool. Default: \c false.
+        bool internStrings_;
+
+        /// \c true if identical lists and dicts of a document share one payload. Default: \c false.
+        bool shareSubtrees_;
+
+        /// Length from which string values are stored in a memory-mapped
+        /// temporary file (see Value::mappedString()); 0 disables it. Default: 0.
+        unsigned int spillThreshold_;
+
+        /// \c true if lists of integers only or strings only are packed (see Value::pack()). Default: \c false.
+        bool packLists_;
+
+        /// \c true if lists and dicts read in canonical form keep their encoding
+        /// (see Value::encoding()), so that writing the document again only
+        /// encodes what was modified. The document is then kept in memory, once,
+        /// next to the tree. Default: \c false.
+        bool keepEncoding_;
+    };
+
+    /** \brief Parses bencode into a Value tree.
+     *
+     * Reader reads Value; BasicReader<Traits> reads BasicValue<Traits>.
+     */
+    template<typename Traits>
+	class BasicReader {
+        typedef BasicValue<Traits> Value;
+        typedef typename Value::Int Int;
+        typedef typename Value::UInt UInt;
     public:
         typedef char Char;
         typedef const Char* Location;
@@ -16,8 +71,12 @@ namespace Bencode {
         /** \brief Constructs a Reader allowing all features
          * for parsing.
          */
-        Reader();
+        BasicReader();
 
+        /** \brief Constructs a Reader allowing the specified feature set
+         * for parsing.
+         */
+        BasicReader(const Features& features);
 
         bool parse(const std::string& document,
             Value& root);
@@ -30,6 +89,25 @@ namespace Bencode {
 
         std::string getFormatedErrorMessages() const;
 
+        /** \brief Subtree sharing done by the last parse, see Features::shareSubtrees_.
+         */
+        class SharingStats
+        {
+        public:
+            SharingStats()
+                : subtrees_(0)
+                , shared_(0)
+                , bytesSaved_(0)
+            {
+            }
+
+            std::size_t subtrees_;      // lists and dicts read
+            std::size_t shared_;        // replaced by an identical earlier subtree
+            std::size_t bytesSaved_;    // heap bytes released by the replacements
+        };
+
+        const SharingStats& getSharingStats() const;
+
     private:
         enum TokenType
         {
@@ -67,9 +145,12 @@ namespace Bencode {
         bool readString();
         bool readNumber();
         bool readNumber(int& num);
+        static bool isCanonicalLength(const Token& token);
         bool readValue();
         bool readDict(Token& token);
         bool readList(Token& token);
+        void shareSubtree(Value& node);
+        void keepEncoding(const Token& token);
         bool decodeNumber(Token& token);
         bool decodeString(Token& token);
         bool decodeString(Token& token, std::vector<char>& decoded);
@@ -105,9 +186,16 @@ namespace Bencode {
         Location current_;
         Location lastValueEnd_;
         Value* lastValue_;
+        Features features_;
+        // completed subtrees of the current document, by content
+        std::unordered_set<Value> subtrees_;
+        SharingStats sharingStats_;
+        Value source_;          // copy of the document pointed to by the encodings kept
+        bool canonical_;        // the last value read was in canonical form
 	};
 
-    std::istream& operator>>(std::istream&, Value&);
+    template<typename Traits>
+    std::istream& operator>>(std::istream&, BasicValue<Traits>&);
     int ctoi(const char c);
 } // namespace Bencode
 
@@ -0,0 +1,71 @@
+#ifndef BENCODE_RECLAIMER_H_INCLUDE
+#define BENCODE_RECLAIMER_H_INCLUDE
+
+#include "value.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace Bencode {
+
+	/** \brief Destroys Values away from the threads that drop them.
+	 *
+	 * dispose() takes the content of a Value in constant time; the tree is
+	 * torn down later, either by a background thread or by the owner at a
+	 * point of its choosing:
+	 * - backgroundThread: a thread owned by the Reclaimer destroys the
+	 *   disposed trees as they arrive.
+	 * - deferred: disposed trees are queued until collect() is called.
+	 *
+	 * Subtrees still referenced elsewhere (copies share their payload) are
+	 * only released, never destroyed while in use. Destruction itself is
+	 * iterative and does not recurse on the native stack.
+	 *
+	 * dispose() may be called from any number of threads.
+	 */
+	class Reclaimer
+	{
+	public:
+		enum Mode
+		{
+			backgroundThread = 0,
+			deferred
+		};
+
+		explicit Reclaimer(Mode mode = backgroundThread);
+
+		/// Destroy everything still queued, then stop the background thread.
+		~Reclaimer();
+
+		/// Move the content of value to the reclaimer; value becomes null.
+		void dispose(Value& value);
+
+		/// Destroy the queued trees on the calling thread.
+		void collect();
+
+		/// Block until every tree disposed before the call has been destroyed.
+		void drain();
+
+		/// Number of trees disposed but not destroyed yet.
+		std::size_t pending() const;
+
+	private:
+		Reclaimer(const Reclaimer&);
+		Reclaimer& operator=(const Reclaimer&);
+
+		void run();
+
+		Mode mode_;
+		mutable std::mutex mutex_;
+		std::condition_variable wakeUp_;
+		std::condition_variable drained_;
+		std::vector<Value> queue_;
+		std::size_t inProgress_;
+		bool stopping_;
+		std::thread thread_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_RECLAIMER_H_INCLUDE
@@ -0,0 +1,318 @@
+#ifndef BENCODE_SINK_H_INCLUDE
+#define BENCODE_SINK_H_INCLUDE
+
+#include "forwards.h"
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iosfwd>
+
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#endif
+
+namespace Bencode {
+
+#if defined(_WIN32)
+	/// Same layout as the POSIX struct iovec.
+	struct IoSlice
+	{
+		void* iov_base;
+		std::size_t iov_len;
+	};
+#else
+	/// Buffer descriptor accepted by writev() and sendmsg().
+	typedef struct iovec IoSlice;
+#endif
+
+	/** \brief Destination of an encoding.
+	 *
+	 * Bytes are appended to a window [current_, end_) with an inlined copy;
+	 * overflow() is only called when the window is full. Once a write has
+	 * failed the sink stays failed and drops everything written to it.
+	 */
+	class OutputSink
+	{
+	public:
+		virtual ~OutputSink();
+
+		void write(const char* data, std::size_t length)
+		{
+			if (std::size_t(end_ - current_) >= length)
+			{
+				memcpy(current_, data, length);
+				current_ += length;
+			}
+			else
+			{
+				overflow(data, length);
+			}
+		}
+
+		void put(char c)
+		{
+			if (current_ != end_)
+				*current_++ = c;
+			else
+				overflow(&c, 1);
+		}
+
+		/// \brief Same as write(), for data that stays valid and unchanged
+		/// until the output has been consumed.
+		///
+		/// Such data may be referenced instead of copied, see GatherSink.
+		void writeReference(const char* data, std::size_t length)
+		{
+			if (length < referenceThreshold_)
+				write(data, length);
+			else
+				reference(data, length);
+		}
+
+		/// Pass the buffered bytes on to the destination.
+		/// \return false if a write failed.
+		virtual bool flush();
+
+		/// false once a write has failed.
+		bool good() const
+		{
+			return !failed_;
+		}
+
+	protected:
+		OutputSink();
+
+		/// Write data when it does not fit in the window.
+		virtual void overflow(const char* data, std::size_t length) = 0;
+
+		/// Take data from writeReference(); copies it by default.
+		virtual void reference(const char* data, std::size_t length);
+
+		char* begin_;
+		char* current_;
+		char* end_;
+		bool failed_;
+		std::size_t referenceThreshold_;	// smallest length given to reference()
+
+	private:
+		OutputSink(const OutputSink&);
+		OutputSink& operator=(const OutputSink&);
+	};
+
+	/** \brief Base of the sinks that pass a fixed-size buffer on to a destination.
+	 *
+	 * The memory used is the buffer size, whatever the size of the output:
+	 * the buffer is drained when it is full, and writes larger than the
+	 * buffer go to the destination directly.
+	 */
+	class BufferedSink : public OutputSink
+	{
+	public:
+		static const std::size_t defaultBufferSize = 64 * 1024;
+
+		virtual bool flush();
+
+	protected:
+		explicit BufferedSink(std::size_t bufferSize);
+
+		/// Write all of data to the destination; return false on error.
+		virtual bool drain(const char* data, std::size_t length) = 0;
+
+		virtual void overflow(const char* data, std::size_t length);
+
+	private:
+		std::vector<char> buffer_;
+	};
+
+	/// Sink writing to a file descriptor (or a socket on POSIX systems).
+	class FileDescriptorSink : public BufferedSink
+	{
+	public:
+		explicit FileDescriptorSink(int fd, std::size_t bufferSize = defaultBufferSize);
+		/// Flush; the descriptor is not closed.
+		virtual ~FileDescriptorSink();
+
+	protected:
+		virtual bool drain(const char* data, std::size_t length);
+
+	private:
+		int fd_;
+	};
+
+	/// Sink writing to a C stream.
+	class FileSink : public BufferedSink
+	{
+	public:
+		explicit FileSink(FILE* file, std::size_t bufferSize = defaultBufferSize);
+		/// Flush; the stream is neither flushed nor closed.
+		virtual ~FileSink();
+
+	protected:
+		virtual bool drain(const char* data, std::size_t length);
+
+	private:
+		FILE* file_;
+	};
+
+	/// Sink writing to a C++ stream.
+	class StreamSink : public BufferedSink
+	{
+	public:
+		explicit StreamSink(std::ostream& stream, std::size_t bufferSize = defaultBufferSize);
+		/// Flush; the stream itself is not flushed.
+		virtual ~StreamSink();
+
+	protected:
+		virtual bool drain(const char* data, std::size_t length);
+
+	private:
+		std::ostream& stream_;
+	};
+
+	/** \brief Sink writing into memory provided by the caller.
+	 *
+	 * Nothing is copied: the encoding is written in place. If it does not
+	 * fit, the sink fails; required() still counts every byte written, so
+	 * that the caller can retry with a large enough buffer.
+	 */
+	class BufferSink : public OutputSink
+	{
+	public:
+		BufferSink(char* buffer, std::size_t capacity);
+
+		char* data() const
+		{
+			return begin_;
+		}
+
+		/// Bytes stored in the buffer.
+		std::size_t size() const
+		{
+			return std::size_t(current_ - begin_);
+		}
+
+		/// Bytes written to the sink, including those that did not fit.
+		std::size_t required() const
+		{
+			return size() + dropped_;
+		}
+
+	protected:
+		virtual void overflow(const char* data, std::size_t length);
+
+	private:
+		std::size_t dropped_;
+	};
+
+	/** \brief Sink accumulating the encoding in a string that can be moved out.
+	 *
+	 * The string grows geometrically; flush() trims it to the bytes written.
+	 */
+	class StringSink : public OutputSink
+	{
+	public:
+		StringSink();
+
+		/// Trim the string to the bytes written.
+		virtual bool flush();
+
+		/// The bytes written, after flush().
+		const std::string& str() const
+		{
+			return string_;
+		}
+
+		char* data()
+		{
+			return begin_;
+		}
+
+		std::size_t size() const
+		{
+			return std::size_t(current_ - begin_);
+		}
+
+		/// Discard the content, keeping the memory.
+		void clear();
+
+		/// Make room for capacity bytes in all, so that writing them does not reallocate.
+		void reserve(std::size_t capacity);
+
+		/// Append length bytes left for the caller to fill in place.
+		/// \return where they start, valid until the next write.
+		char* extend(std::size_t length);
+
+		/// Move the bytes written out; the sink is left empty.
+		std::string take();
+
+	protected:
+		virtual void overflow(const char* data, std::size_t length);
+
+	private:
+		void attach(std::size_t used);
+
+		std::string string_;
+	};
+
+	/** \brief Sink producing the output as a list of slices, for writev() or sendmsg().
+	 *
+	 * Structural bytes, length prefixes and short strings are copied into a
+	 * scratch buffer; strings of threshold bytes or more are referenced in
+	 * place, so that large payloads are never copied. The slices are valid
+	 * after flush() (done by Writer::write()), as long as the sink is not
+	 * written again and the encoded Value is neither modified nor destroyed.
+	 *
+	 * writev() accepts at most IOV_MAX slices per call.
+	 */
+	class GatherSink : public OutputSink
+	{
+	public:
+		static const std::size_t defaultThreshold = 1024;
+
+		explicit GatherSink(std::size_t threshold = defaultThreshold);
+
+		/// Build slices().
+		virtual bool flush();
+
+		const std::vector<IoSlice>& slices() const
+		{
+			return slices_;
+		}
+
+		/// Total length of the slices.
+		std::size_t size() const
+		{
+			return referenced_ + std::size_t(current_ - begin_);
+		}
+
+		/// Discard the content, keeping the memory.
+		void clear();
+
+	protected:
+		virtual void overflow(const char* data, std::size_t length);
+		virtual void reference(const char* data, std::size_t length);
+
+	private:
+		// a run of the scratch buffer (data_ == 0) or referenced data
+		class Piece
+		{
+		public:
+			const char* data_;
+			std::size_t offset_;
+			std::size_t length_;
+		};
+
+		void closeRun();
+
+		std::vector<char> scratch_;
+		std::vector<Piece> pieces_;
+		std::vector<IoSlice> slices_;
+		std::size_t runStart_;	// offset in scratch_ of the bytes not in pieces_ yet
+		std::size_t referenced_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_SINK_H_INCLUDE
@@ -0,0 +1,341 @@
+#include "bencode.h"
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+
+// Regressions found in review, one function each; run without arguments.
+
+// A member changed through a reference taken before the hash was cached
+// must not leave a stale hash on the nodes above it.
+static void testHashAfterMutationThroughReference()
+{
+	Bencode::Value a;
+	a["k"] = 1;
+	a["j"] = 5;
+	Bencode::Value b = a;
+	Bencode::Value& k = a["k"];
+	a.hash();
+	k = 2;
+	b["k"] = 2;
+	assert(a.hash() == b.hash());
+	assert(a == b);
+
+	// the same one level further down, with the root hashed through a set
+	Bencode::Value c;
+	c["info"]["length"] = 10;
+	Bencode::Value& length = c["info"]["length"];
+	std::unordered_set<Bencode::Value> set;
+	set.insert(c);
+	length = 11;
+	Bencode::Value d;
+	d["info"]["length"] = 11;
+	assert(c == d);
+	assert(std::hash<Bencode::Value>()(c) == std::hash<Bencode::Value>()(d));
+}
+
+// == on trees built through references compares each level once, and
+// tells apart trees that differ only at the bottom.
+static void testCompareDeepBuiltTrees()
+{
+	Bencode::Value a;
+	Bencode::Value b;
+	Bencode::Value* leafA = &a;
+	Bencode::Value* leafB = &b;
+	for (int depth = 0; depth < 20000; ++depth)
+	{
+		leafA = &(*leafA)["k"];
+		leafB = &(*leafB)["k"];
+	}
+	*leafA = 1;
+	*leafB = 1;
+	assert(a == b);
+	std::size_t hash = a.hash();
+	assert(a.hash() == hash);
+	*leafB = 2;
+	assert(a != b);
+	assert(a.hash() != b.hash());
+	*leafA = 2;
+	assert(a.hash() == b.hash());
+	assert(a == b);
+}
+
+// bytesSaved_ counts what sharing actually freed, however deep the
+// duplicates are nested.
+static void testSharingBytesSaved()
+{
+	const std::string leaf = "d4:pathl3:dir4:fileee";
+	std::string level = "l" + leaf + leaf + "e";
+	std::string document = "l" + level + level + "l" + level + level + "ee";
+
+	Bencode::Features features;
+	features.shareSubtrees_ = true;
+	Bencode::Reader sharing(features);
+	Bencode::Value shared;
+	assert(sharing.parse(document, shared));
+	Bencode::Reader plain;
+	Bencode::Value copied;
+	assert(plain.parse(document, copied));
+
+	std::size_t freed = copied.memoryUsage().total().bytes_ - shared.memoryUsage().total().bytes_;
+	assert(sharing.getSharingStats().bytesSaved_ == freed);
+}
+
+// Reading a packed list through the const accessors keeps it packed,
+// and so does inserting an element of the same type.
+static void testPackedListReads()
+{
+	Bencode::Value plain(Bencode::listValue);
+	for (int index = 0; index < 1000; ++index)
+		plain.append(index);
+	Bencode::Value packed = plain;
+	assert(packed.pack());
+	const Bencode::Value& list = packed;
+	assert(list[5u].asInt() == 5);
+	int sum = 0;
+	for (Bencode::Value::const_iterator it = list.begin(); it != list.end(); ++it)
+		sum += (*it).asInt();
+	assert(sum == 499500);
+	assert(packed == plain);
+	assert(packed.isPacked());
+	assert(packed.memoryUsage().total().bytes_ < plain.memoryUsage().total().bytes_ / 2);
+
+	assert(packed.insert(0, -1));
+	assert(packed.isPacked() && list.size() == 1001 && list[0u].asInt() == -1 && list[6u].asInt() == 5);
+	assert(packed.insert(1, Bencode::Value("x")));
+	assert(!packed.isPacked() && packed[1u].asString() == "x" && packed[2u].asInt() == 0);
+}
+
+// Reads by value of a packed list do not build its element nodes, and a
+// mutable iterator can not be made from one of its const iterators.
+static void testPackedListReadsByValue()
+{
+	Bencode::Value plain(Bencode::listValue);
+	plain.append(Bencode::Value("ab"));
+	plain.append(Bencode::Value("c"));
+	plain.append(Bencode::Value("def"));
+	Bencode::Value packed = plain;
+	assert(packed.pack());
+	std::size_t bytes = packed.memoryUsage().total().bytes_;
+	assert(packed == plain && plain == packed);
+	Bencode::Value sparse(Bencode::listValue);
+	sparse[2] = Bencode::Value("def");
+	assert(sparse < packed && !(packed < sparse));
+	assert(packed.get(1, Bencode::Value()).asString() == "c");
+	assert(packed.memoryUsage().total().bytes_ == bytes);
+
+	const Bencode::Value& list = packed;
+	bool thrown = false;
+	try
+	{
+		Bencode::Value::iterator it(list.begin());
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	assert(thrown);
+}
+
+// A dict sorted at its end() whose closing 'e' fills the sort buffer.
+static void testEncoderSortedDictAtBufferLimit()
+{
+	for (std::size_t bufferSize = 12; bufferSize <= 13; ++bufferSize)
+	{
+		Bencode::StringSink sink;
+		Bencode::Encoder encoder(sink, bufferSize);
+		encoder.beginDict();
+		encoder.key("b");
+		encoder.integer(1);
+		encoder.key("a");
+		encoder.integer(2);
+		encoder.end();
+		assert(encoder.finish());
+		assert(sink.str() == "d1:ai2e1:bi1ee");
+	}
+}
+
+// Values a Filter copies or drops whole are checked all the same.
+static void testFilterChecksCopiedValues()
+{
+	const char* invalid[] = { "di1ei2ee", "i--e", "d1:ai01ee", "i-0e", "ie", "i-e", "l1:ae1:ae",
+		"d1:ae", "d1:ai1eie", "d1:ai1ee" "e" };
+	const char* valid[] = { "i0e", "i-10e", "d1:ai0e1:bli1ei-2eee", "ld0:0:ee" };
+	Bencode::Filter filter;
+	Bencode::Filter dropping;
+	dropping.drop(".a");
+	for (std::size_t index = 0; index < sizeof(invalid) / sizeof(invalid[0]); ++index)
+	{
+		std::string document = invalid[index];
+		Bencode::StringSink sink;
+		assert(!filter.run(document.data(), document.data() + document.length(), sink));
+	}
+	for (std::size_t index = 0; index < sizeof(valid) / sizeof(valid[0]); ++index)
+	{
+		std::string document = valid[index];
+		Bencode::StringSink sink;
+		assert(filter.run(document.data(), document.data() + document.length(), sink));
+		assert(sink.str() == document);
+	}
+	std::string document = "d1:ai01e1:bi1ee";
+	Bencode::StringSink sink;
+	assert(!dropping.run(document.data(), document.data() + document.length(), sink));
+	document = "d1:ai0e1:bi1ee";
+	Bencode::StringSink dropped;
+	assert(dropping.run(document.data(), document.data() + document.length(), dropped));
+	assert(dropped.str() == "d1:bi1ee");
+}
+
+// writeParallel() places the runs it sizes exactly where write() puts them.
+static void testWriteParallelMatchesWrite()
+{
+	Bencode::Value files(Bencode::listValue);
+	for (int index = 0; index < 1000; ++index)
+	{
+		Bencode::Value file(Bencode::dictValue);
+		file["length"] = index * 37 - 500;
+		file["path"].append(Bencode::Value("file" + std::to_string(index)));
+		files.append(file);
+	}
+	Bencode::Value packed(Bencode::listValue);
+	for (int index = 0; index < 100; ++index)
+		packed.append(index);
+	assert(packed.pack());
+	Bencode::Value torrent;
+	torrent["info"]["files"] = files;
+	torrent["info"]["packed"] = packed;
+	torrent["info"]["pieces"] = Bencode::Value(std::string(100000, 'p'));
+	torrent["announce"] = Bencode::Value("http://tracker.example/announce");
+
+	Bencode::Writer writer;
+	Bencode::UInt length = writer.write(torrent);
+	std::string expected(writer.getCString(), length);
+	for (unsigned int threads = 2; threads <= 8; threads *= 2)
+	{
+		Bencode::Writer parallel;
+		Bencode::UInt parallelLength = parallel.writeParallel(torrent, threads);
+		assert(std::string(parallel.getCString(), parallelLength) == expected);
+	}
+}
+
+// A list with missing indices thaws with its members at the same indices.
+static void testFrozenSparseList()
+{
+	Bencode::Value list(Bencode::listValue);
+	list[5] = 1;
+	list[9] = Bencode::Value("x");
+	Bencode::Value root;
+	root["sparse"] = list;
+	root["dense"].append(2);
+	Bencode::FrozenValue frozen(root);
+	const Bencode::Value& thawed = frozen.value();
+	assert(thawed == root);
+	assert(thawed["sparse"].size() == 10);
+	assert(thawed["sparse"][9].asStringView() == "x");
+}
+
+// Queries search deeply nested documents without recursing per level, and
+// reject indices that do not fit in an ArrayIndex.
+static void testQueryDeepNestingAndIndexRange()
+{
+	Bencode::Value root(Bencode::listValue);
+	Bencode::Value* current = &root;
+	for (int depth = 0; depth < 300000; ++depth)
+		current = &current->append(Bencode::Value(Bencode::listValue));
+	(*current)[0u]["x"] = 7;
+	int found = 0;
+	Bencode::Query("..x").evaluate(root, [&found](const Bencode::Value& node)
+		{
+			assert(node.asInt() == 7);
+			++found;
+		});
+	assert(found == 1);
+	assert(Bencode::Query("..*").first(root) == &root[0u]);
+
+	bool thrown = false;
+	try
+	{
+		Bencode::Query query("[4294967297]");
+	}
+	catch (const std::runtime_error& error)
+	{
+		thrown = std::string(error.what()).find("Invalid query") == 0;
+	}
+	assert(thrown);
+}
+
+// writeParallel() splits a deeply nested document without recursing per level.
+static void testWriteParallelDeepNesting()
+{
+	Bencode::Value root(Bencode::listValue);
+	Bencode::Value* current = &root;
+	for (int depth = 0; depth < 200000; ++depth)
+	{
+		current->append(depth);
+		current = &current->append(Bencode::Value(Bencode::listValue));
+	}
+	Bencode::Writer writer;
+	Bencode::UInt length = writer.write(root);
+	Bencode::Writer parallel;
+	Bencode::UInt parallelLength = parallel.writeParallel(root, 4);
+	assert(std::string(parallel.getCString(), parallelLength) == std::string(writer.getCString(), length));
+}
+
+// The torrent and KRPC instantiations are read, modified and written next
+// to Value in one program; torrent integers keep their 64 bits.
+static void testValueTraitsCoexist()
+{
+	typedef Bencode::BasicValue<Bencode::TorrentValueTraits> TorrentValue;
+	typedef Bencode::BasicValue<Bencode::KrpcValueTraits> KrpcValue;
+
+	std::string torrentDocument = "d6:lengthi5368709120e4:name4:filee";
+	TorrentValue torrent;
+	Bencode::BasicReader<Bencode::TorrentValueTraits> torrentReader;
+	assert(torrentReader.parse(torrentDocument, torrent));
+	assert(torrent["length"].asInt() == 5368709120LL);
+	torrent["pieces"] = TorrentValue(3000000000LL);
+	Bencode::BasicWriter<Bencode::TorrentValueTraits> torrentWriter;
+	TorrentValue::UInt torrentLength = torrentWriter.write(torrent);
+	assert(std::string(torrentWriter.getCString(), torrentLength)
+		== "d6:lengthi5368709120e4:name4:file6:piecesi3000000000ee");
+
+	std::string query = "d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe";
+	KrpcValue krpc;
+	Bencode::BasicReader<Bencode::KrpcValueTraits> krpcReader;
+	assert(krpcReader.parse(query, krpc));
+	assert(krpc["q"].asStringView() == "ping");
+	std::unordered_set<KrpcValue> seen;
+	seen.insert(krpc);
+	krpc["t"] = KrpcValue("bb");
+	assert(seen.count(krpc) == 0);
+	Bencode::BasicWriter<Bencode::KrpcValueTraits> krpcWriter;
+	Bencode::UInt krpcLength = krpcWriter.write(krpc);
+	assert(std::string(krpcWriter.getCString(), krpcLength)
+		== "d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:bb1:y1:qe");
+
+	Bencode::Value value;
+	Bencode::Reader reader;
+	assert(reader.parse(query, value));
+	Bencode::Writer writer;
+	Bencode::UInt length = writer.write(value);
+	assert(std::string(writer.getCString(), length) == query);
+}
+
+int main()
+{
+	testHashAfterMutationThroughReference();
+	testCompareDeepBuiltTrees();
+	testSharingBytesSaved();
+	testPackedListReads();
+	testPackedListReadsByValue();
+	testEncoderSortedDictAtBufferLimit();
+	testFilterChecksCopiedValues();
+	testWriteParallelMatchesWrite();
+	testWriteParallelDeepNesting();
+	testFrozenSparseList();
+	testQueryDeepNestingAndIndexRange();
+	testValueTraitsCoexist();
+	std::cout << "OK" << std::endl;
+	return 0;
+}
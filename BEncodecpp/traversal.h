@@ -0,0 +1,109 @@
+#ifndef BENCODE_TRAVERSAL_H_INCLUDE
+#define BENCODE_TRAVERSAL_H_INCLUDE
+
+#include "value.h"
+#include <string_view>
+#include <vector>
+
+namespace Bencode {
+
+	/** \brief Non-recursive depth-first walk over a Value tree.
+	 *
+	 * The pending containers are kept on an explicit stack, so arbitrarily
+	 * deep documents are walked in constant native stack space. The stack is
+	 * kept between calls: reusing one Traversal does not allocate once it has
+	 * grown to the document depth.
+	 *
+	 * Visitor is any type providing, in document order:
+	 * - void visitNull(const Value& node);
+	 * - void visitInt(const Value& node);
+	 * - void visitString(const Value& node);
+	 * - bool beginList(const Value& node); void endList(const Value& node);
+	 * - bool beginDict(const Value& node); void endDict(const Value& node);
+	 * - void visitKey(std::string_view key); called before each dict member.
+	 *
+	 * When beginList() or beginDict() returns false the container's children
+	 * and its end callback are skipped.
+	 *
+	 * Traversal walks Value; BasicTraversal<Traits> walks BasicValue<Traits>.
+	 */
+	template<typename Traits>
+	class BasicTraversal
+	{
+		typedef BasicValue<Traits> Value;
+	public:
+		template<typename Visitor>
+		void traverse(const Value& root, Visitor& visitor)
+		{
+			stack_.clear();
+			enter(root, visitor);
+			while (!stack_.empty())
+			{
+				Frame& frame = stack_.back();
+				if (frame.current_ == frame.end_)
+				{
+					const Value& node = *frame.node_;
+					stack_.pop_back();
+					if (node.type() == listValue)
+						visitor.endList(node);
+					else
+						visitor.endDict(node);
+					continue;
+				}
+				if (frame.node_->type() == dictValue)
+					visitor.visitKey(frame.current_.memberNameView());
+				const Value& child = *frame.current_;
+				++frame.current_;
+				enter(child, visitor);	// may grow stack_: frame is not used past this point
+			}
+		}
+
+	private:
+		class Frame
+		{
+		public:
+			const Value* node_;
+			typename Value::const_iterator current_;
+			typename Value::const_iterator end_;
+		};
+
+		template<typename Visitor>
+		void enter(const Value& node, Visitor& visitor)
+		{
+			switch (node.type())
+			{
+			case nullValue:
+				visitor.visitNull(node);
+				break;
+			case intValue:
+				visitor.visitInt(node);
+				break;
+			case stringValue:
+				visitor.visitString(node);
+				break;
+			case listValue:
+				if (visitor.beginList(node))
+					push(node);
+				break;
+			case dictValue:
+				if (visitor.beginDict(node))
+					push(node);
+				break;
+			}
+		}
+
+		void push(const Value& node)
+		{
+			Frame frame;
+			frame.node_ = &node;
+			frame.current_ = node.begin();
+			frame.end_ = node.end();
+			stack_.push_back(frame);
+		}
+
+		std::vector<Frame> stack_;
+	};
+
+} // namespace Bencode
+
+#endif // !BENCODE_TRAVERSAL_H_INCLUDE
@@ -3,9 +3,17 @@
 
 #include "forwards.h"
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <map>
+#include <functional>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
 
 namespace Bencode {
 	
@@ -43,16 +51,230 @@ namespace Bencode {
 		const char* str_;
 	};
 
-	class Value
+	/** \brief Heap memory owned by a Value subtree, see Value::memoryUsage().
+	 *
+	 * bytes_ is the exact number of bytes requested from the allocators;
+	 * blockBytes_ adds an estimate of the heap's per-block header and rounding.
+	 */
+	class MemoryUsage
+	{
+	public:
+		class Entry
+		{
+		public:
+			Entry()
+				: allocations_(0)
+				, bytes_(0)
+				, blockBytes_(0)
+			{
+			}
+
+			std::size_t allocations_;
+			std::size_t bytes_;
+			std::size_t blockBytes_;
+		};
+
+		/// Sum of all the categories below.
+		Entry total() const;
+
+		Entry strings_;	// string payloads
+		Entry keys_;	// dict member names
+		Entry lists_;	// list payloads and element nodes
+		Entry dicts_;	// dict payloads and member nodes
+	};
+
+	/// Memory hooks for list and dict nodes, see ValueAllocator::setCounters().
+	void* allocateValueNode(std::size_t size);
+	void releaseValueNode(void* node, std::size_t size);
+
+	/// Contiguous storage of a compacted subtree, see Value::compact().
+	class ValueArena;
+	/// Nodes allocated here are released all at once, with the arena.
+	void* allocateArenaNode(ValueArena* arena, std::size_t size);
+
+	/** \brief std::allocator replacement used for the nodes of list and dict values.
+	 */
+	template<typename T>
+	class ValueNodeAllocator
+	{
+	public:
+		typedef T value_type;
+
+		ValueNodeAllocator()
+			: arena_(0)
+		{
+		}
+
+		explicit ValueNodeAllocator(ValueArena* arena)
+			: arena_(arena)
+		{
+		}
+
+		template<typename U>
+		ValueNodeAllocator(const ValueNodeAllocator<U>& other)
+			: arena_(other.arena())
+		{
+		}
+
+		/// Copies of a container go back to the heap.
+		ValueNodeAllocator select_on_container_copy_construction() const
+		{
+			return ValueNodeAllocator();
+		}
+
+		T* allocate(std::size_t n)
+		{
+			if (arena_)
+				return static_cast<T*>(allocateArenaNode(arena_, n * sizeof(T)));
+			return static_cast<T*>(allocateValueNode(n * sizeof(T)));
+		}
+
+		void deallocate(T* p, std::size_t n)
+		{
+			if (!arena_)
+				releaseValueNode(p, n * sizeof(T));
+		}
+
+		ValueArena* arena() const
+		{
+			return arena_;
+		}
+
+		template<typename U>
+		bool operator==(const ValueNodeAllocator<U>& other) const
+		{
+			return arena_ == other.arena();
+		}
+
+		template<typename U>
+		bool operator!=(const ValueNodeAllocator<U>& other) const
+		{
+			return arena_ != other.arena();
+		}
+
+	private:
+		ValueArena* arena_;
+	};
+
+	/** \brief String storage of ValueTraits, through the installed ValueAllocator.
+	 *
+	 * A Strings policy of BasicValue duplicates and frees string values
+	 * and member names; length is never ValueAllocator::unknown.
+	 */
+	class AllocatorStrings
+	{
+	public:
+		static char* makeMemberName(const char* memberName, unsigned int length);
+		static void releaseMemberName(char* memberName);
+		static char* duplicateStringValue(const char* value, unsigned int length);
+		static void releaseStringValue(char* value);
+	};
+
+	/** \brief String storage bound to malloc() at compile time, so that its calls can be inlined.
+	 */
+	class MallocStrings
+	{
+	public:
+		static char* makeMemberName(const char* memberName, unsigned int length)
+		{
+			return duplicateStringValue(memberName, length);
+		}
+
+		static void releaseMemberName(char* memberName)
+		{
+			releaseStringValue(memberName);
+		}
+
+		static char* duplicateStringValue(const char* value, unsigned int length)
+		{
+			char* newString = static_cast<char*>(malloc(length + 1));
+			if (!newString)
+				throw std::bad_alloc();
+			memcpy(newString, value, length);
+			newString[length] = 0;
+			return newString;
+		}
+
+		static void releaseStringValue(char* value)
+		{
+			free(value);
+		}
+	};
+
+	/** \brief Compile-time choices of a BasicValue, and of the BasicReader and
+	 * BasicWriter working on it.
+	 *
+	 * - Int, UInt: the integer types.
+	 * - Strings: the storage of string values and member names, with the
+	 *   interface of AllocatorStrings.
+	 * - NodeAllocator<T>: the allocator of the list and dict nodes.
+	 *   ValueNodeAllocator keeps the ValueAllocator::setCounters()
+	 *   accounting of the nodes, and is the only one Value::compact() can
+	 *   place in its arena.
+	 * - Dict<Key, T, Compare, Allocator>: the container of list and dict
+	 *   members. It must have the interface, the ordering and the stable
+	 *   element addresses of std::map.
+	 *
+	 * The member functions are defined in the .cpp files and instantiated
+	 * there for ValueTraits, TorrentValueTraits and KrpcValueTraits, which
+	 * can be used together in a program. Other traits need their explicit
+	 * instantiations added next to those.
+	 */
+	class ValueTraits
 	{
-		friend class ValueIteratorBase;
 	public:
-		typedef std::vector<std::string> Members;
-		typedef ValueIterator iterator;
-		typedef ValueConstIterator const_iterator;
 		typedef Bencode::Int Int;
 		typedef Bencode::UInt UInt;
-		typedef UInt ArrayIndex;
+		typedef AllocatorStrings Strings;
+
+		template<typename T>
+		using NodeAllocator = ValueNodeAllocator<T>;
+
+		template<typename Key, typename T, typename Compare, typename Allocator>
+		using Dict = std::map<Key, T, Compare, Allocator>;
+	};
+
+	/// Torrents: 64-bit integers, so that file sizes above 2 GiB decode and encode exactly.
+	class TorrentValueTraits : public ValueTraits
+	{
+	public:
+		typedef long long Int;
+		typedef unsigned long long UInt;
+	};
+
+	/// KRPC messages, small and short-lived: strings from malloc() and nodes
+	/// from std::allocator, both bound at compile time, without accounting.
+	class KrpcValueTraits : public ValueTraits
+	{
+	public:
+		typedef MallocStrings Strings;
+
+		template<typename T>
+		using NodeAllocator = std::allocator<T>;
+	};
+
+	/** \brief A bencode value: null, integer, string, list or dict.
+	 *
+	 * Value is the instantiation for ValueTraits; see ValueTraits for the
+	 * others.
+	 */
+	template<typename Traits>
+	class BasicValue
+	{
+		typedef BasicValue Value;	// this instantiation, in the member declarations and definitions
+
+		template<typename> friend class BasicValueIteratorBase;
+		template<typename> friend class BasicStringPool;
+		friend class FrozenValue;
+		template<typename> friend class BasicWriter;
+		template<typename> friend class BasicReader;
+	public:
+		typedef std::vector<std::string> Members;
+		typedef BasicValueIterator<Traits> iterator;
+		typedef BasicValueConstIterator<Traits> const_iterator;
+		typedef typename Traits::Int Int;
+		typedef typename Traits::UInt UInt;
+		typedef Bencode::ArrayIndex ArrayIndex;
 
 		static const Value null;
 		static const Int minInt;
@@ -72,6 +294,7 @@ namespace Bencode {
 			};
 			CZString(int index);
 			CZString(const char* cstr, DuplicationPolicy allocate);
+			CZString(const char* cstr, UInt length, DuplicationPolicy allocate);
 			CZString(const CZString& other);
 			~CZString();
 			CZString& operator =(const CZString& other);
@@ -79,29 +302,52 @@ namespace Bencode {
 			bool operator==(const CZString& other) const;
 			int index() const;
 			const char* c_str() const;
+			UInt length() const;
 			bool isStaticString() const;
 		private:
 			void swap(CZString& other);
 			const char* cstr_;
 			int index_;
+			UInt length_;
 		};
 
 	public:
-		typedef std::map<CZString, Value> ObjectValues;
+		typedef typename Traits::template Dict<CZString, Value, std::less<CZString>,
+			typename Traits::template NodeAllocator<std::pair<const CZString, Value> > > ObjectValues;
 
-		Value(ValueType type = nullValue);
-		Value(Int value);
-		Value(const char* value, UInt length);
-		Value(const char* beginValue, const char* endValue);
+		BasicValue(ValueType type = nullValue);
+		BasicValue(Int value);
+		BasicValue(const char* value, UInt length);
+		BasicValue(const char* beginValue, const char* endValue);
 
+		/** \brief Construct a string value stored in a memory-mapped temporary file.
+		 *
+		 * The content is read through the same accessors as any string, but
+		 * its pages are backed by the file rather than the heap, so the
+		 * system can evict them. Falls back to a heap copy if the file can
+		 * not be created. \sa Features::spillThreshold_
+		 */
+		static Value mappedString(const char* value, UInt length);
 
-		Value(const StaticString& value);
-		Value(const std::string& value);
 
-		Value(const Value& other);
-		~Value();
+		BasicValue(const StaticString& value);
+		BasicValue(const std::string& value);
+
+		/// \brief Copy constructor, O(1).
+		///
+		/// String, list and dict payloads are reference counted and shared
+		/// between copies. The first mutating access on a shared list or dict
+		/// (non-const operator[], append(), removeMember(), clear(), non-const
+		/// begin()/end()) clones that level only; nested values stay shared.
+		/// As with any implicitly shared container, a non-const reference or
+		/// iterator obtained before the Value is copied must not be used to
+		/// mutate it afterwards.
+		BasicValue(const Value& other);
+		BasicValue(Value&& other);
+		~BasicValue();
 
 		Value& operator=(const Value& other);
+		Value& operator=(Value&& other);
 
 		void swap(Value& other);
 
@@ -115,9 +361,24 @@ namespace Bencode {
 		bool operator ==(const Value& other) const;
 		bool operator !=(const Value& other) const;
 
+		/// \brief Content hash, equal for values with the same bencode encoding.
+		///
+		/// Computed lazily and cached on each list and dict node; mutating
+		/// access to a node drops its cached hash. Once a member has been
+		/// handed out by non-const reference (operator[], iterator), the node
+		/// and those above it keep their hash only until the next mutation of
+		/// any Value, since the member may change through that reference at
+		/// any time.
+		std::size_t hash() const;
+
 
 		const char* asCString() const;
 		std::string asString() const;
+		/// \brief Return a view on the string bytes without copying them.
+		///
+		/// Unlike asCString(), embedded NULs are preserved. The view stays valid
+		/// while this value, or a copy sharing its payload, is alive.
+		std::string_view asStringView() const;
 
 		Int asInt() const;
 
@@ -143,21 +404,53 @@ namespace Bencode {
 		/// in the array so that its size is index+1.
 		/// (You may need to say 'value[0u]' to get your compiler to distinguish
 		///  this from the operator[] which takes a string.)
-		Value& operator[](UInt index);
+		Value& operator[](ArrayIndex index);
 		/// Access an array element (zero based index )
 		/// (You may need to say 'value[0u]' to get your compiler to distinguish
 		///  this from the operator[] which takes a string.)
-		const Value& operator[](UInt index) const;
+		const Value& operator[](ArrayIndex index) const;
 		/// If the array contains at least index+1 elements, returns the element value, 
 		/// otherwise returns defaultValue.
-		Value get(UInt index,
+		Value get(ArrayIndex index,
 			const Value& defaultValue) const;
 		/// Return true if index < size().
-		bool isValidIndex(UInt index) const;
+		bool isValidIndex(ArrayIndex index) const;
 		/// \brief Append value to array at the end.
 		///
 		/// Equivalent to jsonvalue[jsonvalue.size()] = value;
 		Value& append(const Value& value);
+		/// \brief Insert value in the list before element index.
+		///
+		/// A packed list stays packed when value has the type of its elements.
+		/// \return false, and nothing inserted, if index > size().
+		bool insert(ArrayIndex index, const Value& value);
+
+		/** \brief Store a list whose elements are all integers, or all strings, contiguously.
+		 *
+		 * The elements of a packed list are kept in one array (integers, or
+		 * string bytes back to back) instead of one node per element, and can
+		 * be scanned through packedInts() or packedStrings(). size(), hashing,
+		 * comparison, get(ArrayIndex), memoryUsage() and Writer read the
+		 * packed form.
+		 *
+		 * The const accessors returning references (operator[], begin(),
+		 * end()) build one Value per element next to the packed arrays the
+		 * first time they are used, and the list stays packed. insert() of an element of the same type keeps
+		 * it packed as well; any other mutation, and the non-const accessors,
+		 * which hand out references, return the list to the general form.
+		 *
+		 * \return true if the list is packed, false if it is not a non-empty
+		 * list of integers only or strings only.
+		 */
+		bool pack();
+		bool isPacked() const;
+		/// Elements of a packed list of integers, or 0.
+		const Int* packedInts() const;
+		/// Bytes of a packed list of strings that all have the same length
+		/// (returned in stride), or 0.
+		const char* packedStrings(UInt& stride) const;
+		/// Element index of a packed list of strings, or an empty view.
+		std::string_view packedString(ArrayIndex index) const;
 
 		/// Access an object value by name, create a null member if it does not exist.
 		Value& operator[](const char* key);
@@ -170,6 +463,17 @@ namespace Bencode {
 
 		Value& operator[](const StaticString& key);
 
+		/// \brief Look up the member named key without inserting it.
+		///
+		/// Keys are compared as raw bytes, so binary keys are supported.
+		/// \return the member, or 0 if this is not a dict or has no such member.
+		const Value* find(std::string_view key) const;
+
+		/// \brief Same as find(std::string_view), through the cache of lookup.
+		///
+		/// \sa MemberLookup
+		const Value* find(const MemberLookup& lookup) const;
+
 		/// Return the member named key if it exist, defaultValue otherwise.
 		Value get(const char* key,
 			const Value& defaultValue) const;
@@ -204,6 +508,40 @@ namespace Bencode {
 		/// If is not a string type, return 0.
 		UInt getStringLength() const;
 
+		/** \brief The bytes this list or dict was parsed from, or an empty view.
+		 *
+		 * Kept by a Reader with Features::keepEncoding_, for the containers
+		 * whose input was already in canonical form, and dropped by the first
+		 * mutating access to the container (one that would copy it if it were
+		 * shared). Reaching a nested value for writing goes through such an
+		 * access on every container above it, so only the containers on the
+		 * modified paths lose their encoding. Writer copies the encoding of
+		 * the others instead of walking them.
+		 */
+		std::string_view encoding() const;
+
+		/// \brief Return the heap memory owned by this subtree.
+		///
+		/// A payload shared by several values of the subtree is counted once.
+		MemoryUsage memoryUsage() const;
+
+		/** \brief Relocate this subtree into contiguous memory, in depth-first order.
+		 *
+		 * Payloads, member nodes, member names and strings are copied into
+		 * one arena in the order Traversal and Writer visit them, so that a
+		 * tree scattered by a long series of mutations regains the locality
+		 * of a freshly parsed one. Payloads shared inside the subtree stay
+		 * shared; those shared with values outside of it are copied. Packed
+		 * lists, static, mapped and pooled strings are kept as they are.
+		 *
+		 * A compacted list or dict is moved back to the heap, one level at a
+		 * time, the first time it is mutated. The arena is freed when the
+		 * last value pointing into it is destroyed.
+		 *
+		 * Does nothing if this is not a list or dict.
+		 */
+		void compact();
+
 		//std::string toStyledString() const;
 
 		const_iterator begin() const;
@@ -213,19 +551,93 @@ namespace Bencode {
 		iterator end();
 
 	private:
+		struct StringRep;
+		struct PackedList;
+		struct ObjectRep;
+		class MemoryCollector;
+		class HashVisitor;
+		class Compactor;
+
 		Value& resolveReference(const char* key,
+			UInt length,
 			bool isStatic);
+		Value removeMember(const CZString& key);
+
+		/// Make the list or dict payload unshared, and on the heap, before it is mutated.
+		void detachObject();
+		/// detachObject(), before a member is handed out by non-const reference.
+		void exposeObject();
+		/// No reference to the members of this list or dict is live any more:
+		/// its hash can be cached again.
+		void sealObject();
+		/// Whether this list or dict can be taken apart by popFront() without
+		/// copying: its payload is unshared, on the heap and not packed.
+		bool isConsumable() const;
+		/// Move the first member of a consumable list or dict into member,
+		/// and its name into key for a dict, then free its node.
+		/// \return false if there is no member left.
+		bool popFront(Value& member, std::string& key);
+		/// Remember that this list or dict was parsed from the length bytes at
+		/// offset in source, a string holding the whole document.
+		void setEncoding(const Value& source, std::size_t offset, std::size_t length);
+		/// The part of memoryUsage() that destroying this value would free:
+		/// payloads also held elsewhere are left out.
+		MemoryUsage exclusiveMemoryUsage() const;
+		void releasePayload();
+		static void destroyObject(ObjectRep* rep);
+
+		/// Three-way comparison; equalityOnly allows answering "different"
+		/// (non-zero, unordered) from the cached hashes.
+		static int compare(const Value& a, const Value& b, bool equalityOnly);
+		static int compareNode(const Value& a, const Value& b, bool equalityOnly, bool& descend);
+		static int comparePacked(const Value& a, const Value& b);
 
 	private:
 		union ValueHolder
 		{
 			Int int_;
-			char* string_;
-			ObjectValues* map_;
+			StringRep* string_;
+			ObjectRep* map_;
 		} value_;
-		UInt stringlength_;
 		ValueType type_ : 8;
-		int allocated_ : 1;
+	};
+
+	/** \brief Member name with an inline cache, for repeated lookups in dicts of the same layout.
+	 *
+	 * The lookup remembers the position of the key among the members of the
+	 * last dict it was found in. The next Value::find() checks that position
+	 * first, which costs one key comparison when the dict has the same key
+	 * layout, and falls back to a binary search otherwise.
+	 *
+	 * The positions index a table of the members that a dict builds once it
+	 * has served a few cached lookups, and drops when it is modified. Until
+	 * then a lookup is a plain find() and the dict allocates nothing, so
+	 * documents read once cost no more than with find(), and the cache pays
+	 * off on dicts read many times, such as documents scanned repeatedly
+	 * with a set of lookups:
+	 * \code
+	 * static const MemberLookup info("info"), pieceLength("piece length");
+	 * const Value* dict = root.find(info);
+	 * const Value* length = dict ? dict->find(pieceLength) : 0;
+	 * \endcode
+	 *
+	 * A MemberLookup may be shared by several threads.
+	 */
+	class MemberLookup
+	{
+	public:
+		explicit MemberLookup(const char* key);
+		explicit MemberLookup(const std::string& key);
+		MemberLookup(const MemberLookup& other);
+
+		const std::string& key() const;
+
+	private:
+		template<typename> friend class BasicValue;
+		MemberLookup& operator=(const MemberLookup&);
+
+		std::string key_;
+		mutable std::atomic<ArrayIndex> position_;
 	};
 
 	/** \brief Experimental and untested: represents an element of the "path" to access a node.
@@ -236,7 +648,7 @@ namespace Bencode {
 		friend class Path;
 
 		PathArgument();
-		PathArgument(UInt index);
+		PathArgument(ArrayIndex index);
 		PathArgument(const char* key);
 		PathArgument(const std::string& key);
 
@@ -248,7 +660,7 @@ namespace Bencode {
 			kindKey
 		};
 		std::string key_;
-		UInt index_;
+		ArrayIndex index_;
 		Kind kind_;
 	};
 
@@ -309,25 +721,92 @@ namespace Bencode {
 
 		virtual ~ValueAllocator();
 
-		virtual char* makeMemberName(const char* memberName) = 0;
+		virtual char* makeMemberName(const char* memberName,
+			unsigned int length = unknown) = 0;
 		virtual void releaseMemberName(char* memberName) = 0;
 		virtual char* duplicateStringValue(const char* value,
 			unsigned int length = unknown) = 0;
 		virtual void releaseStringValue(char* value) = 0;
+
+		/** \brief Global count of the heap memory held by all Values.
+		 *
+		 * Covers string payloads, member names, and list and dict nodes.
+		 */
+		class Counters
+		{
+		public:
+			Counters()
+				: bytes_(0)
+				, allocations_(0)
+			{
+			}
+
+			std::atomic<long long> bytes_;
+			std::atomic<long long> allocations_;
+		};
+
+		/// \brief Install counters updated on every Value allocation, or 0 to stop counting.
+		///
+		/// Install them before creating the Values to be measured: memory
+		/// released after installation is subtracted even if it was allocated before.
+		static void setCounters(Counters* counters);
+		static Counters* counters();
+	};
+
+	/** \brief Process-wide pool of string values shared across documents.
+	 *
+	 * Interning returns a string Value referencing the single pooled copy of
+	 * its content, so documents repeating the same strings (tracker URLs,
+	 * "created by", file names) hold one payload between them. The pool
+	 * only keeps weak entries: a string is dropped from it when the last
+	 * Value referencing it is destroyed.
+	 *
+	 * The pool is thread-safe; entries are spread over independently locked
+	 * stripes selected by the string hash.
+	 *
+	 * Each BasicValue instantiation has its own pool, StringPool being the
+	 * one of Value.
+	 *
+	 * \sa Features::internStrings_
+	 */
+	template<typename Traits>
+	class BasicStringPool
+	{
+		typedef BasicValue<Traits> Value;
+	public:
+		/// Return a string Value sharing the pooled copy of value[0..length).
+		static Value intern(const char* value, unsigned int length);
+		static Value intern(const std::string& value);
+
+		/// Number of distinct strings currently pooled.
+		static std::size_t size();
+
+	private:
+		friend class BasicValue<Traits>;
+		class Stripe;
+
+		static Stripe* stripes();
+		static Stripe& stripeFor(const char* value, unsigned int length);
+		static void forget(typename Value::StringRep* rep);
 	};
 
 	/** \brief base class for Value iterators.
 	 *
 	 */
-	class ValueIteratorBase
+	template<typename Traits>
+	class BasicValueIteratorBase
 	{
+	protected:
+		typedef BasicValue<Traits> Value;
 	public:
 		typedef unsigned int size_t;
 		typedef int difference_type;
-		typedef ValueIteratorBase SelfType;
+		typedef BasicValueIteratorBase SelfType;
 
-		ValueIteratorBase();
-		explicit ValueIteratorBase(const Value::ObjectValues::iterator& current);
+		BasicValueIteratorBase();
+		explicit BasicValueIteratorBase(const typename Value::ObjectValues::iterator& current);
+		/// Over the elements of a packed list, see Value::pack().
+		BasicValueIteratorBase(Value* elements, Value* element);
 
 		bool operator ==(const SelfType& other) const
 		{
@@ -353,6 +832,9 @@ namespace Bencode {
 		/// Return the member name of the referenced Value. "" if it is not an objectValue.
 		const char* memberName() const;
 
+		/// Same as memberName(), as a view that also covers binary member names.
+		std::string_view memberNameView() const;
+
 	protected:
 		Value& deref() const;
 
@@ -367,7 +849,16 @@ namespace Bencode {
 		void copy(const SelfType& other);
 
 	private:
-		Value::ObjectValues::iterator current_;
+		friend class BasicValue<Traits>;
+		friend class BasicValueIterator<Traits>;
+
+		// Order of the keys referenced by two iterators of containers of one type.
+		int compareKey(const SelfType& other) const;
+
+		typename Value::ObjectValues::iterator current_;
+		// Elements of a packed list and the referenced one; current_ is unused then.
+		Value* elements_;
+		Value* element_;
 		// Indicates that iterator is for a null value.
 		bool isNull_;
 	};
@@ -375,22 +866,25 @@ namespace Bencode {
 	/** \brief const iterator for dict and list value.
 	 *
 	 */
-	class ValueConstIterator :public ValueIteratorBase
+	template<typename Traits>
+	class BasicValueConstIterator :public BasicValueIteratorBase<Traits>
 	{
-		friend class Value;
+		typedef BasicValue<Traits> Value;
+		friend class BasicValue<Traits>;
 	public:
 		typedef unsigned int size_t;
 		typedef int difference_type;
 		typedef const Value& reference;
 		typedef const Value* pointer;
-		typedef ValueConstIterator SelfType;
+		typedef BasicValueConstIterator SelfType;
 
-		ValueConstIterator();
+		BasicValueConstIterator();
 	private:
-		explicit ValueConstIterator(const Value::ObjectValues::iterator& current);
+		explicit BasicValueConstIterator(const typename Value::ObjectValues::iterator& current);
+		BasicValueConstIterator(const Value* elements, const Value* element);
 	
 	public:
-		SelfType& operator =(const ValueIteratorBase& other);
+		SelfType& operator =(const BasicValueIteratorBase<Traits>& other);
 
 		SelfType operator++(int)
 		{
@@ -408,40 +902,44 @@ namespace Bencode {
 
 		SelfType& operator--()
 		{
-			decrement();
+			this->decrement();
 			return *this;
 		}
 
 		SelfType& operator++()
 		{
-			increment();
+			this->increment();
 			return *this;
 		}
 
 		reference operator *() const
 		{
-			return deref();
+			return this->deref();
 		}
 	};
 
 	/** \brief Iterator for dict and list value.
 	 */
-	class ValueIterator :public ValueIteratorBase
+	template<typename Traits>
+	class BasicValueIterator :public BasicValueIteratorBase<Traits>
 	{
-		friend class Value;
+		typedef BasicValue<Traits> Value;
+		friend class BasicValue<Traits>;
 	public:
 		typedef unsigned int size_t;
 		typedef int difference_type;
 		typedef Value& reference;
 		typedef Value* pointer;
-		typedef ValueIterator SelfType;
+		typedef BasicValueIterator SelfType;
 
-		ValueIterator();
-		ValueIterator(const ValueConstIterator& other);
-		ValueIterator(const ValueIterator& other);
+		BasicValueIterator();
+		/// \throw std::runtime_error if other iterates a packed list, whose
+		/// elements can not be modified in place.
+		BasicValueIterator(const BasicValueConstIterator<Traits>& other);
+		BasicValueIterator(const BasicValueIterator& other);
 
 	private:
-		explicit ValueIterator(const Value::ObjectValues::iterator& current);
+		explicit BasicValueIterator(const typename Value::ObjectValues::iterator& current);
 
 	public:
 		SelfType& operator =(const SelfType& other);
@@ -462,22 +960,35 @@ namespace Bencode {
 
 		SelfType& operator--()
 		{
-			decrement();
+			this->decrement();
 			return *this;
 		}
 
 		SelfType& operator++()
 		{
-			increment();
+			this->increment();
 			return *this;
 		}
 
 		reference operator *() const
 		{
-			return deref();
+			return this->deref();
 		}
 	};
 
 } // namespace Bencode
 
+namespace std {
+
+	template<typename Traits>
+	struct hash<Bencode::BasicValue<Traits> >
+	{
+		std::size_t operator()(const Bencode::BasicValue<Traits>& value) const
+		{
+			return value.hash();
+		}
+	};
+
+} // namespace std
+
 #endif // !BENCODE_VALUE_H_INCLUDE
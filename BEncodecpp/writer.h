@@ -2,32 +2,191 @@
 #define BENCODE_WRITER_H_INCLUDE
 
 #include "value.h"
+#include "traversal.h"
+#include "sink.h"
 #include <vector>
 #include <string>
 #include <iostream>
 
 namespace Bencode {
 
-	class Value;
-
-	class Writer {
+	/** \brief Encodes a Value tree to bencode.
+	 *
+	 * Containers are walked in place: keys and values are read from the
+	 * stored nodes and nothing is copied. Once the traversal stack has grown
+	 * to the document depth, write() allocates nothing but the output buffer.
+	 *
+	 * A list or dict that still has the encoding it was parsed from (see
+	 * Features::keepEncoding_) is copied from it in one piece, so writing a
+	 * document read that way costs a walk of the modified paths only, plus
+	 * the copy of the rest.
+	 *
+	 * Writer encodes Value; BasicWriter<Traits> encodes BasicValue<Traits>.
+	 */
+	template<typename Traits>
+	class BasicWriter {
+		typedef BasicValue<Traits> Value;
 	public:
-		Writer();
-		~Writer() {}
+		typedef typename Value::Int Int;
+		typedef typename Value::UInt UInt;
+
+		BasicWriter();
+		~BasicWriter() {}
 
 	public:
 
+		/// Encode root in the writer's own buffer, see getCString().
+		/// \return the length of the encoding.
 		UInt write(const Value& root);
 
+		/// \brief Encode root to sink, then flush the sink.
+		///
+		/// With a BufferedSink the encoding is streamed out as it is produced,
+		/// in constant memory. With a GatherSink large strings are referenced
+		/// in root instead of copied.
+		/// \return false if the sink failed.
+		bool write(const Value& root, OutputSink& sink);
+
+		/** \brief Encode root to sink, then flush the sink, freeing root as it goes.
+		 *
+		 * Each member of a list or dict is released as soon as it has been
+		 * written, so that, with a BufferedSink, the peak memory is about the
+		 * tree alone rather than the tree plus its encoding. Payloads shared
+		 * with other Values, packed lists and compacted containers are
+		 * written whole, then released. root is left null.
+		 *
+		 * Strings are always copied to the sink, since they are freed once
+		 * written: a GatherSink references nothing.
+		 * \return false if the sink failed.
+		 */
+		bool write(Value&& root, OutputSink& sink);
+
+		/// The encoding made by write(const Value&).
 		char* getCString();
 
+		/// Move the encoding made by write(const Value&) out of the writer.
+		std::string take();
+
+		/** \brief Exact length of the encoding of root, computed without encoding it.
+		 *
+		 * Lets the caller allocate the output once: a StringSink::reserve(),
+		 * or a BufferSink over a mapped file or a network buffer that
+		 * receives the encoding with no intermediate copy.
+		 */
+		std::size_t encodedSize(const Value& root);
+
+		/** \brief Same as write(const Value&), with the encoding spread over
+		 * threadCount threads (0 = hardware concurrency).
+		 *
+		 * The members of root are cut into runs of consecutive members, a few
+		 * per thread; a container with too few members to be cut this way is
+		 * descended into instead. The runs are sized in parallel, as by
+		 * encodedSize(), and placed in the output; each is then encoded by
+		 * one thread straight into its place, so the output is identical to
+		 * that of write(const Value&) and is not copied.
+		 *
+		 * root must not be modified during the call.
+		 */
+		UInt writeParallel(const Value& root, unsigned int threadCount = 0);
+
 	private:
+		class DocumentVisitor;
+		class SizeVisitor;
+		class ParallelPlan;
+
 		void writeValue(const Value& root);
 		void valueToString(Int value);
-		void valueToString(std::string str);
 		void valueToString(const char* value, UInt length);
+		void writeStored(const char* data, std::size_t length);
+
+		StringSink document_;
+		OutputSink* sink_;	// during write()
+		bool referenceStrings_;	// false while consuming a tree
+		BasicTraversal<Traits> traversal_;
+	};
+
+	/** \brief Push-style encoder, writing bencode to a sink without building a Value tree.
+	 *
+	 * \code
+	 * Bencode::Encoder encoder(sink);
+	 * encoder.beginDict();
+	 * encoder.key("length"); encoder.integer(size);
+	 * encoder.key("name"); encoder.string(name);
+	 * encoder.end();
+	 * encoder.finish();
+	 * \endcode
+	 *
+	 * Nesting is validated, and dict keys must be given in raw byte order,
+	 * without duplicates. Memory use is proportional to the nesting depth
+	 * (and the length of the keys), whatever the size of the output.
+	 *
+	 * With a non-zero sortBufferSize, dicts whose keys arrive out of order
+	 * are also accepted: members are held in a buffer of at most that many
+	 * bytes and sorted when the dict ends. When the buffer fills up, the
+	 * dicts it holds are written out if their keys are in order so far.
+	 *
+	 * Misuse (a value where a key is expected, unsorted or duplicate keys,
+	 * an overflowing sort buffer, ...) throws std::runtime_error.
+	 */
+	class Encoder
+	{
+	public:
+		explicit Encoder(OutputSink& sink, std::size_t sortBufferSize = 0);
+
+		void beginDict();
+		void beginList();
+		/// Close the innermost dict or list.
+		void end();
+
+		/// Name of the next dict member.
+		void key(std::string_view name);
+
+		void integer(Int value);
+		void string(std::string_view value);
+
+		/// \brief Check that exactly one complete value was encoded, then flush the sink.
+		/// \return false if the sink failed.
+		bool finish();
+
+	private:
+		Encoder(const Encoder&);
+		Encoder& operator=(const Encoder&);
+
+		class Member
+		{
+		public:
+			std::size_t start_;	// offset in buffer_ of the key prefix
+			std::size_t keyStart_;
+			std::size_t keyLength_;
+		};
+
+		class Frame
+		{
+		public:
+			bool isDict_;
+			bool hasKey_;	// a key waits for its value
+			bool buffered_;	// members are kept in buffer_ until the end of the dict
+			bool sorted_;	// keys arrived in order so far
+			bool hasLastKey_;
+			std::string lastKey_;
+			std::size_t contentStart_;	// buffered: offset in buffer_ of the first member
+			std::vector<Member> members_;	// buffered only
+		};
+
+		void beginValue();
+		void beginContainer(bool isDict);
+		void sortMembers(Frame& frame);
+		void emit(const char* data, std::size_t length);
+		void spill();
+		static void fail(const char* message);
 
-		std::vector<char> document_;
+		OutputSink& sink_;
+		std::size_t sortBufferSize_;
+		std::string buffer_;
+		std::vector<Frame> frames_;	// kept across containers to reuse their memory
+		std::size_t depth_;
+		std::size_t bufferedDepth_;	// number of buffered frames
+		bool done_;
 	};
 	
 } // namespace Bencode